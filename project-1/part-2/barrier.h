@@ -0,0 +1,387 @@
+#ifndef BARRIER_H
+#define BARRIER_H
+
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#ifdef __linux__
+    #include <limits.h>
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+/*
+    Reusable barriers for a fixed team of threads. Every thread passes its
+    index in the team (0 to thread_count - 1) to `barrier_wait`.
+
+    * Centralized: one counter and a sense flag that is flipped every episode.
+      Cheapest for a few threads, but every arrival hits the same cache line.
+    * Combining tree: threads arrive at leaves of a tree with a fan-in of four,
+      the last one to arrive at a node climbs to the parent, so every counter
+      is shared by at most four threads. The last thread at the root flips
+      the sense flag.
+    * Dissemination: ceil(log2(N)) rounds. In round r, thread i signals thread
+      (i + 2^r) mod N and waits for its own signal. No thread waits on a
+      counter, and every flag has exactly one writer and one reader.
+
+    A waiting thread spins for `spin_count` pauses and then sleeps on a futex
+    (on Linux) until the flag changes.
+*/
+
+#define BARRIER_CACHE_LINE_SIZE 64
+#define BARRIER_TREE_FAN_IN 4
+#define BARRIER_DEFAULT_SPIN_COUNT 20000
+
+typedef enum _barrier_type
+{
+    BARRIER_CENTRALIZED,
+    BARRIER_TREE,
+    BARRIER_DISSEMINATION
+} barrier_type_t;
+
+static const char *Barrier_Type_Names[] = {
+    "centralized",
+    "tree",
+    "dissemination"
+};
+
+/* Barrier Flag */
+
+typedef struct _barrier_flag
+{
+    volatile uint32_t value;
+    volatile uint32_t waiters;
+} __attribute__((aligned(BARRIER_CACHE_LINE_SIZE))) barrier_flag_t;
+
+static inline void _barrier_flag_wait(barrier_flag_t *flag, uint32_t value, size_t spin_count)
+{
+    for (size_t i = 0; i < spin_count; ++i) {
+        if (value == flag->value) {
+            return;
+        }
+
+        utils_cpu_relax();
+    }
+
+    while (true) {
+        uint32_t current = flag->value;
+        if (value == current) {
+            return;
+        }
+
+#ifdef __linux__
+        __sync_fetch_and_add(&flag->waiters, 1);
+        syscall(SYS_futex, &flag->value, FUTEX_WAIT_PRIVATE, current, NULL, NULL, 0);
+        __sync_fetch_and_sub(&flag->waiters, 1);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+static inline void _barrier_flag_set(barrier_flag_t *flag, uint32_t value)
+{
+    __sync_lock_test_and_set(&flag->value, value);
+
+#ifdef __linux__
+    /* Pairs with the increment of `waiters` before the futex wait. */
+    __sync_synchronize();
+    if (0 != flag->waiters) {
+        syscall(SYS_futex, &flag->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+#endif
+}
+
+/* Barrier Tree Node */
+
+typedef struct _barrier_tree_node
+{
+    volatile ssize_t count;
+    ssize_t arity;
+    ssize_t parent;
+} __attribute__((aligned(BARRIER_CACHE_LINE_SIZE))) barrier_tree_node_t;
+
+/* Barrier Thread State */
+
+typedef struct _barrier_thread_state
+{
+    uint32_t sense;
+    uint32_t parity;
+} __attribute__((aligned(BARRIER_CACHE_LINE_SIZE))) barrier_thread_state_t;
+
+/* Barrier */
+
+typedef struct _barrier
+{
+    barrier_type_t type;
+    size_t thread_count;
+    size_t spin_count;
+
+    barrier_thread_state_t *threads;
+
+    /* Centralized and Tree */
+    barrier_flag_t sense;
+    volatile ssize_t count;
+    barrier_tree_node_t *nodes;
+    size_t node_count;
+
+    /* Dissemination: flags[(thread * 2 + parity) * round_count + round] */
+    barrier_flag_t *flags;
+    size_t round_count;
+} barrier_t;
+
+static inline void *_barrier_allocate_aligned(size_t size)
+{
+    void *memory = NULL;
+    if (0 != posix_memalign(&memory, BARRIER_CACHE_LINE_SIZE, size)) {
+        return NULL;
+    }
+    memset(memory, 0, size);
+
+    return memory;
+}
+
+static inline barrier_t *barrier_allocate(void)
+{
+    return (barrier_t *) _barrier_allocate_aligned(sizeof(barrier_t));
+}
+
+static barrier_t *_barrier_init_tree(barrier_t *barrier)
+{
+    size_t thread_count = barrier->thread_count;
+
+    size_t node_count = 0;
+    for (size_t level_size = thread_count; ;) {
+        level_size = (level_size - 1) / BARRIER_TREE_FAN_IN + 1;
+        node_count += level_size;
+        if (1 == level_size) {
+            break;
+        }
+    }
+
+    barrier->nodes =
+        (barrier_tree_node_t *) _barrier_allocate_aligned(sizeof(*barrier->nodes) * node_count);
+    if (NULL == barrier->nodes) {
+        return NULL;
+    }
+    barrier->node_count = node_count;
+
+    /* Levels are laid out from the leaves to the root. */
+    size_t level_start = 0;
+    size_t children = thread_count;
+    while (true) {
+        size_t level_size = (children - 1) / BARRIER_TREE_FAN_IN + 1;
+        size_t parent_start = level_start + level_size;
+
+        for (size_t i = 0; i < level_size; ++i) {
+            barrier_tree_node_t *node = &barrier->nodes[level_start + i];
+
+            size_t arity = children - i * BARRIER_TREE_FAN_IN;
+            node->arity = (ssize_t) (arity > BARRIER_TREE_FAN_IN ? BARRIER_TREE_FAN_IN : arity);
+            node->count = node->arity;
+            node->parent =
+                1 == level_size ?
+                    -1 : (ssize_t) (parent_start + i / BARRIER_TREE_FAN_IN);
+        }
+
+        if (1 == level_size) {
+            break;
+        }
+
+        level_start = parent_start;
+        children = level_size;
+    }
+
+    return barrier;
+}
+
+static barrier_t *barrier_init(barrier_t *barrier, barrier_type_t type, size_t thread_count)
+{
+    barrier->type = type;
+    barrier->thread_count = 0 == thread_count ? 1 : thread_count;
+    barrier->spin_count = BARRIER_DEFAULT_SPIN_COUNT;
+
+    barrier->sense.value = 0;
+    barrier->sense.waiters = 0;
+    barrier->count = (ssize_t) barrier->thread_count;
+    barrier->nodes = NULL;
+    barrier->node_count = 0;
+    barrier->flags = NULL;
+    barrier->round_count = 0;
+
+    barrier->threads =
+        (barrier_thread_state_t *) _barrier_allocate_aligned(
+                                       sizeof(*barrier->threads) * barrier->thread_count
+                                   );
+    if (NULL == barrier->threads) {
+        return NULL;
+    }
+
+    switch (type) {
+        case BARRIER_CENTRALIZED:
+            break;
+        case BARRIER_TREE:
+            if (NULL == _barrier_init_tree(barrier)) {
+                free(barrier->threads);
+                barrier->threads = NULL;
+
+                return NULL;
+            }
+            break;
+        case BARRIER_DISSEMINATION:
+            while (((size_t) 1 << barrier->round_count) < barrier->thread_count) {
+                barrier->round_count += 1;
+            }
+
+            if (0 < barrier->round_count) {
+                barrier->flags =
+                    (barrier_flag_t *) _barrier_allocate_aligned(
+                                           sizeof(*barrier->flags) *
+                                               barrier->thread_count * 2 * barrier->round_count
+                                       );
+                if (NULL == barrier->flags) {
+                    free(barrier->threads);
+                    barrier->threads = NULL;
+
+                    return NULL;
+                }
+            }
+
+            /* Flags start at zero, so the first episode waits for a one. */
+            for (size_t i = 0; i < barrier->thread_count; ++i) {
+                barrier->threads[i].sense = 1;
+            }
+            break;
+        default:
+            free(barrier->threads);
+            barrier->threads = NULL;
+
+            return NULL;
+    }
+
+    return barrier;
+}
+
+static inline barrier_t *barrier_create(barrier_type_t type, size_t thread_count)
+{
+    barrier_t *barrier = barrier_allocate();
+    if (NULL == barrier) {
+        return barrier;
+    }
+
+    if (NULL == barrier_init(barrier, type, thread_count)) {
+        free(barrier);
+
+        return NULL;
+    }
+
+    return barrier;
+}
+
+static void barrier_destroy(barrier_t *barrier)
+{
+    if (NULL == barrier) {
+        return;
+    }
+
+    free(barrier->threads);
+    free(barrier->nodes);
+    free(barrier->flags);
+    free(barrier);
+}
+
+/* Zero makes waiting threads go to sleep right away. */
+static inline void barrier_set_spin_count(barrier_t *barrier, size_t spin_count)
+{
+    barrier->spin_count = spin_count;
+}
+
+static inline void _barrier_wait_centralized(barrier_t *barrier, size_t thread_index)
+{
+    barrier_thread_state_t *state = &barrier->threads[thread_index];
+    state->sense ^= 1;
+
+    if (0 == __sync_sub_and_fetch(&barrier->count, 1)) {
+        barrier->count = (ssize_t) barrier->thread_count;
+        _barrier_flag_set(&barrier->sense, state->sense);
+    } else {
+        _barrier_flag_wait(&barrier->sense, state->sense, barrier->spin_count);
+    }
+}
+
+static inline void _barrier_wait_tree(barrier_t *barrier, size_t thread_index)
+{
+    barrier_thread_state_t *state = &barrier->threads[thread_index];
+    state->sense ^= 1;
+
+    ssize_t node_index = (ssize_t) (thread_index / BARRIER_TREE_FAN_IN);
+    while (-1 != node_index) {
+        barrier_tree_node_t *node = &barrier->nodes[node_index];
+        if (0 != __sync_sub_and_fetch(&node->count, 1)) {
+            _barrier_flag_wait(&barrier->sense, state->sense, barrier->spin_count);
+
+            return;
+        }
+
+        /* Nobody touches this node again before the sense flips. */
+        node->count = node->arity;
+        node_index = node->parent;
+    }
+
+    _barrier_flag_set(&barrier->sense, state->sense);
+}
+
+static inline void _barrier_wait_dissemination(barrier_t *barrier, size_t thread_index)
+{
+    barrier_thread_state_t *state = &barrier->threads[thread_index];
+
+    size_t thread_count = barrier->thread_count;
+    size_t round_count = barrier->round_count;
+
+    for (size_t round = 0; round < round_count; ++round) {
+        size_t partner = (thread_index + ((size_t) 1 << round)) % thread_count;
+
+        barrier_flag_t *partner_flag =
+            &barrier->flags[(partner * 2 + state->parity) * round_count + round];
+        barrier_flag_t *own_flag =
+            &barrier->flags[(thread_index * 2 + state->parity) * round_count + round];
+
+        _barrier_flag_set(partner_flag, state->sense);
+        _barrier_flag_wait(own_flag, state->sense, barrier->spin_count);
+    }
+
+    if (1 == state->parity) {
+        state->sense ^= 1;
+    }
+    state->parity ^= 1;
+}
+
+static void barrier_wait(barrier_t *barrier, size_t thread_index)
+{
+    if (1 == barrier->thread_count) {
+        return;
+    }
+
+    switch (barrier->type) {
+        case BARRIER_CENTRALIZED:
+            _barrier_wait_centralized(barrier, thread_index);
+            break;
+        case BARRIER_TREE:
+            _barrier_wait_tree(barrier, thread_index);
+            break;
+        case BARRIER_DISSEMINATION:
+            _barrier_wait_dissemination(barrier, thread_index);
+            break;
+    }
+
+    __sync_synchronize();
+}
+
+#endif // BARRIER_H
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include "barrier.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+    Measures the latency of one barrier episode for every barrier type and
+    team size from one thread to the number of cores. Thread i is pinned to
+    core i (on Linux) so runs are comparable. Results are written as CSV.
+*/
+
+static const size_t Default_Episodes = 100000;
+static const size_t Warmup_Episodes = 1000;
+
+typedef struct _barrier_bench_thread
+{
+    barrier_t *barrier;
+    size_t index;
+    size_t episodes;
+    uint64_t elapsed_ns;
+} barrier_bench_thread_t;
+
+static void pin_current_thread(size_t core)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % utils_get_number_of_cpu_cores(), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) core;
+#endif
+}
+
+static void *barrier_bench_thread_start(void *args)
+{
+    barrier_bench_thread_t *thread = (barrier_bench_thread_t *) args;
+    pin_current_thread(thread->index);
+
+    for (size_t i = 0; i < Warmup_Episodes; ++i) {
+        barrier_wait(thread->barrier, thread->index);
+    }
+
+    uint64_t start = utils_get_monotonic_time_ns();
+    for (size_t i = 0; i < thread->episodes; ++i) {
+        barrier_wait(thread->barrier, thread->index);
+    }
+    thread->elapsed_ns = utils_get_monotonic_time_ns() - start;
+
+    return NULL;
+}
+
+static int run_benchmark(barrier_type_t type, size_t thread_count, size_t episodes)
+{
+    barrier_t *barrier = barrier_create(type, thread_count);
+    if (NULL == barrier) {
+        fputs("Failed to create a barrier.\n", stderr);
+        return -1;
+    }
+
+    pthread_t *threads = (pthread_t *) malloc(sizeof(*threads) * thread_count);
+    barrier_bench_thread_t *data = (barrier_bench_thread_t *) malloc(sizeof(*data) * thread_count);
+    if (NULL == threads || NULL == data) {
+        fputs("Out of memory.\n", stderr);
+
+        free(threads);
+        free(data);
+        barrier_destroy(barrier);
+
+        return -1;
+    }
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        data[i].barrier = barrier;
+        data[i].index = i;
+        data[i].episodes = episodes;
+        data[i].elapsed_ns = 0;
+
+        pthread_create(&threads[i], NULL, barrier_bench_thread_start, &data[i]);
+    }
+
+    uint64_t slowest_ns = 0;
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i], NULL);
+        if (data[i].elapsed_ns > slowest_ns) {
+            slowest_ns = data[i].elapsed_ns;
+        }
+    }
+
+    printf(
+        "%s,%zu,%zu,%.1f\n",
+        Barrier_Type_Names[type],
+        thread_count,
+        episodes,
+        (double) slowest_ns / (double) episodes
+    );
+    fflush(stdout);
+
+    free(data);
+    free(threads);
+    barrier_destroy(barrier);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int Base = 10;
+
+    size_t episodes = Default_Episodes;
+    if (argc > 1) {
+        episodes = (size_t) strtoul(argv[1], NULL, Base);
+    }
+
+    size_t core_count = utils_get_number_of_cpu_cores();
+
+    printf("barrier,threads,episodes,ns_per_episode\n");
+    for (int type = BARRIER_CENTRALIZED; type <= BARRIER_DISSEMINATION; ++type) {
+        for (size_t thread_count = 1; ; thread_count *= 2) {
+            if (thread_count > core_count) {
+                thread_count = core_count;
+            }
+
+            if (0 != run_benchmark((barrier_type_t) type, thread_count, episodes)) {
+                return EXIT_FAILURE;
+            }
+
+            if (thread_count == core_count) {
+                break;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
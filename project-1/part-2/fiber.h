@@ -0,0 +1,467 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+#include "threadpool.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+/*
+    Fibers are pool tasks with their own stack. A fiber that reads or writes a
+    file hands the request to one of the scheduler's I/O threads and switches
+    back to the worker, which goes on executing other tasks. When the I/O
+    completes, the fiber is enqueued to the pool again and is resumed by
+    whichever worker takes it. Compute-bound work therefore keeps all cores
+    busy while the disk is slow.
+
+    The request is handed over only after the fiber's context has been saved
+    (by the worker, right after the switch), so an I/O thread can never
+    resume a fiber that is still running.
+
+    Stacks are allocated with mmap with a guard page below and are kept in a
+    pool for reuse. Fiber code must not cache addresses of thread-local
+    variables across `fiber_read`/`fiber_write`, as the fiber may come back on
+    another thread.
+*/
+
+#define FIBER_DEFAULT_STACK_SIZE (128 * 1024)
+#define FIBER_STACK_POOL_CAPACITY 64
+
+typedef struct _fiber_scheduler fiber_scheduler_t;
+
+typedef enum _fiber_state
+{
+    FIBER_READY,
+    FIBER_SUSPENDED,
+    FIBER_FINISHED
+} fiber_state_t;
+
+typedef struct _fiber_io_request
+{
+    int descriptor;
+    void *buffer;
+    size_t count;
+    off_t offset;
+    bool is_write;
+
+    ssize_t result;
+    int error;
+} fiber_io_request_t;
+
+typedef struct _fiber
+{
+    ucontext_t context;
+    ucontext_t *return_context;
+
+    void *stack;
+
+    void (*task)(void *task_data, void (*result_callback)(void *result));
+    void *task_data;
+    void (*result_callback)(void *result);
+
+    fiber_state_t state;
+    fiber_io_request_t io_request;
+
+    fiber_scheduler_t *scheduler;
+} fiber_t;
+
+/* Fiber Scheduler */
+
+struct _fiber_scheduler
+{
+    threadpool_t *threadpool;
+
+    sync_queue_t *io_requests;
+    pthread_t *io_threads;
+    size_t io_thread_count;
+
+    size_t stack_size;
+    size_t guard_size;
+    pthread_mutex_t stack_mutex;
+    void *free_stacks[FIBER_STACK_POOL_CAPACITY];
+    size_t free_stack_count;
+
+    volatile ssize_t active_fibers;
+    pthread_mutex_t completion_mutex;
+    pthread_cond_t completion_condition;
+};
+
+static __thread fiber_t *_fiber_current = NULL;
+
+/* Not inlined, so the compiler cannot reuse a thread-local address computed on another thread. */
+static __attribute__((noinline)) fiber_t *fiber_get_current(void)
+{
+    __asm__ __volatile__ ("" ::: "memory");
+
+    return _fiber_current;
+}
+
+static __attribute__((noinline)) void _fiber_set_current(fiber_t *fiber)
+{
+    __asm__ __volatile__ ("" ::: "memory");
+
+    _fiber_current = fiber;
+}
+
+static void *_fiber_scheduler_allocate_stack(fiber_scheduler_t *scheduler)
+{
+    void *stack = NULL;
+
+    pthread_mutex_lock(&scheduler->stack_mutex);
+    if (0 < scheduler->free_stack_count) {
+        stack = scheduler->free_stacks[--scheduler->free_stack_count];
+    }
+    pthread_mutex_unlock(&scheduler->stack_mutex);
+
+    if (NULL != stack) {
+        return stack;
+    }
+
+    size_t mapping_size = scheduler->guard_size + scheduler->stack_size;
+    void *mapping =
+        mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mapping) {
+        return NULL;
+    }
+
+    /* Stacks grow down: an overflow hits the inaccessible page instead of a neighbour. */
+    mprotect(mapping, scheduler->guard_size, PROT_NONE);
+
+    return (uint8_t *) mapping + scheduler->guard_size;
+}
+
+static void _fiber_scheduler_release_stack(fiber_scheduler_t *scheduler, void *stack)
+{
+    pthread_mutex_lock(&scheduler->stack_mutex);
+    if (scheduler->free_stack_count < FIBER_STACK_POOL_CAPACITY) {
+        scheduler->free_stacks[scheduler->free_stack_count++] = stack;
+        stack = NULL;
+    }
+    pthread_mutex_unlock(&scheduler->stack_mutex);
+
+    if (NULL != stack) {
+        munmap((uint8_t *) stack - scheduler->guard_size, scheduler->guard_size + scheduler->stack_size);
+    }
+}
+
+static void _fiber_perform_io(fiber_io_request_t *request)
+{
+    request->result =
+        request->is_write ?
+            pwrite(request->descriptor, request->buffer, request->count, request->offset) :
+            pread(request->descriptor, request->buffer, request->count, request->offset);
+    request->error = request->result < 0 ? errno : 0;
+}
+
+static void _fiber_resume_task(void *task_data, void (*result_callback)(void *result));
+
+static void *_fiber_io_thread_start(void *args)
+{
+    fiber_scheduler_t *scheduler = (fiber_scheduler_t *) args;
+
+    while (true) {
+        void *element = sync_queue_deque(scheduler->io_requests);
+        if (NULL == element) {
+            continue;
+        }
+
+        /* The scheduler itself is the stop request. */
+        if (element == scheduler) {
+            break;
+        }
+
+        fiber_t *fiber = (fiber_t *) element;
+        _fiber_perform_io(&fiber->io_request);
+
+        fiber->state = FIBER_READY;
+        threadpool_enqueue_named_task(scheduler->threadpool, "fiber", _fiber_resume_task, fiber, NULL);
+    }
+
+    return NULL;
+}
+
+static inline fiber_scheduler_t *fiber_scheduler_allocate(void)
+{
+    return (fiber_scheduler_t *) malloc(sizeof(fiber_scheduler_t));
+}
+
+static fiber_scheduler_t *fiber_scheduler_init(
+                             fiber_scheduler_t *scheduler,
+                             threadpool_t *threadpool,
+                             size_t io_thread_count,
+                             size_t stack_size
+                         )
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size < 1) {
+        page_size = 4096;
+    }
+
+    if (0 == stack_size) {
+        stack_size = FIBER_DEFAULT_STACK_SIZE;
+    }
+
+    scheduler->threadpool = threadpool;
+    scheduler->io_thread_count = 0 == io_thread_count ? 1 : io_thread_count;
+    scheduler->stack_size = ((stack_size - 1) / (size_t) page_size + 1) * (size_t) page_size;
+    scheduler->guard_size = (size_t) page_size;
+    scheduler->free_stack_count = 0;
+    scheduler->active_fibers = 0;
+
+    if (0 != pthread_mutex_init(&scheduler->stack_mutex, NULL)) {
+        return NULL;
+    }
+
+    if (0 != pthread_mutex_init(&scheduler->completion_mutex, NULL)) {
+        pthread_mutex_destroy(&scheduler->stack_mutex);
+
+        return NULL;
+    }
+
+    if (0 != pthread_cond_init(&scheduler->completion_condition, NULL)) {
+        pthread_mutex_destroy(&scheduler->completion_mutex);
+        pthread_mutex_destroy(&scheduler->stack_mutex);
+
+        return NULL;
+    }
+
+    scheduler->io_requests = sync_queue_create();
+    scheduler->io_threads = (pthread_t *) malloc(sizeof(pthread_t) * scheduler->io_thread_count);
+    if (NULL == scheduler->io_requests || NULL == scheduler->io_threads) {
+        sync_queue_destroy(scheduler->io_requests);
+        free(scheduler->io_threads);
+
+        pthread_cond_destroy(&scheduler->completion_condition);
+        pthread_mutex_destroy(&scheduler->completion_mutex);
+        pthread_mutex_destroy(&scheduler->stack_mutex);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < scheduler->io_thread_count; ++i) {
+        pthread_create(&scheduler->io_threads[i], NULL, _fiber_io_thread_start, scheduler);
+    }
+
+    return scheduler;
+}
+
+static inline fiber_scheduler_t *fiber_scheduler_create(
+                                     threadpool_t *threadpool,
+                                     size_t io_thread_count,
+                                     size_t stack_size
+                                 )
+{
+    fiber_scheduler_t *scheduler = fiber_scheduler_allocate();
+    if (NULL == scheduler) {
+        return scheduler;
+    }
+
+    if (NULL == fiber_scheduler_init(scheduler, threadpool, io_thread_count, stack_size)) {
+        free(scheduler);
+
+        return NULL;
+    }
+
+    return scheduler;
+}
+
+/* Waits until every fiber spawned so far has finished. */
+static void fiber_scheduler_wait(fiber_scheduler_t *scheduler)
+{
+    pthread_mutex_lock(&scheduler->completion_mutex);
+    while (0 < scheduler->active_fibers) {
+        pthread_cond_wait(&scheduler->completion_condition, &scheduler->completion_mutex);
+    }
+    pthread_mutex_unlock(&scheduler->completion_mutex);
+}
+
+static void fiber_scheduler_destroy(fiber_scheduler_t *scheduler)
+{
+    if (NULL == scheduler) {
+        return;
+    }
+
+    fiber_scheduler_wait(scheduler);
+
+    for (size_t i = 0; i < scheduler->io_thread_count; ++i) {
+        sync_queue_enqueue(scheduler->io_requests, scheduler);
+    }
+
+    for (size_t i = 0; i < scheduler->io_thread_count; ++i) {
+        pthread_join(scheduler->io_threads[i], NULL);
+    }
+    free(scheduler->io_threads);
+    sync_queue_destroy(scheduler->io_requests);
+
+    for (size_t i = 0; i < scheduler->free_stack_count; ++i) {
+        munmap(
+            (uint8_t *) scheduler->free_stacks[i] - scheduler->guard_size,
+            scheduler->guard_size + scheduler->stack_size
+        );
+    }
+
+    pthread_cond_destroy(&scheduler->completion_condition);
+    pthread_mutex_destroy(&scheduler->completion_mutex);
+    pthread_mutex_destroy(&scheduler->stack_mutex);
+
+    free(scheduler);
+}
+
+/* Fiber */
+
+static void _fiber_entry(void)
+{
+    fiber_t *fiber = fiber_get_current();
+
+    fiber->task(fiber->task_data, fiber->result_callback);
+
+    /* Could have been resumed on another worker than the one that started it. */
+    fiber = fiber_get_current();
+    fiber->state = FIBER_FINISHED;
+    setcontext(fiber->return_context);
+}
+
+static void _fiber_destroy(fiber_t *fiber)
+{
+    fiber_scheduler_t *scheduler = fiber->scheduler;
+
+    _fiber_scheduler_release_stack(scheduler, fiber->stack);
+    free(fiber);
+
+    if (0 == __sync_sub_and_fetch(&scheduler->active_fibers, 1)) {
+        pthread_mutex_lock(&scheduler->completion_mutex);
+        pthread_cond_broadcast(&scheduler->completion_condition);
+        pthread_mutex_unlock(&scheduler->completion_mutex);
+    }
+}
+
+static void _fiber_resume_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    fiber_t *fiber = (fiber_t *) task_data;
+
+    /* A fiber can resume another one while it helps in `threadpool_sync`. */
+    fiber_t *previous_fiber = fiber_get_current();
+
+    ucontext_t return_context;
+    fiber->return_context = &return_context;
+
+    _fiber_set_current(fiber);
+    swapcontext(&return_context, &fiber->context);
+    _fiber_set_current(previous_fiber);
+
+    switch (fiber->state) {
+        case FIBER_FINISHED:
+            _fiber_destroy(fiber);
+            break;
+        case FIBER_SUSPENDED:
+            if (NULL == sync_queue_enqueue(fiber->scheduler->io_requests, fiber)) {
+                _fiber_perform_io(&fiber->io_request);
+                fiber->state = FIBER_READY;
+                threadpool_enqueue_named_task(fiber->scheduler->threadpool, "fiber", _fiber_resume_task, fiber, NULL);
+            }
+            break;
+        case FIBER_READY:
+            break;
+    }
+}
+
+static fiber_t *fiber_spawn(
+                    fiber_scheduler_t *scheduler,
+                    void (*task)(void *task_data, void (*result_callback)(void *result)),
+                    void *task_data,
+                    void (*result_callback)(void *result)
+                )
+{
+    fiber_t *fiber = (fiber_t *) malloc(sizeof(*fiber));
+    if (NULL == fiber) {
+        return fiber;
+    }
+
+    fiber->stack = _fiber_scheduler_allocate_stack(scheduler);
+    if (NULL == fiber->stack) {
+        free(fiber);
+
+        return NULL;
+    }
+
+    if (0 != getcontext(&fiber->context)) {
+        _fiber_scheduler_release_stack(scheduler, fiber->stack);
+        free(fiber);
+
+        return NULL;
+    }
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = scheduler->stack_size;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, _fiber_entry, 0);
+
+    fiber->return_context = NULL;
+    fiber->task = task;
+    fiber->task_data = task_data;
+    fiber->result_callback = result_callback;
+    fiber->state = FIBER_READY;
+    fiber->scheduler = scheduler;
+
+    __sync_add_and_fetch(&scheduler->active_fibers, 1);
+    threadpool_enqueue_named_task(scheduler->threadpool, "fiber", _fiber_resume_task, fiber, NULL);
+
+    return fiber;
+}
+
+static ssize_t _fiber_submit_io(fiber_io_request_t *request)
+{
+    fiber_t *fiber = fiber_get_current();
+
+    /* Outside of a fiber there is nothing to switch to. */
+    if (NULL == fiber) {
+        _fiber_perform_io(request);
+        if (0 != request->error) {
+            errno = request->error;
+        }
+
+        return request->result;
+    }
+
+    fiber->io_request = *request;
+    fiber->state = FIBER_SUSPENDED;
+    swapcontext(&fiber->context, fiber->return_context);
+
+    fiber = fiber_get_current();
+    if (0 != fiber->io_request.error) {
+        errno = fiber->io_request.error;
+    }
+
+    return fiber->io_request.result;
+}
+
+/* Same as pread, but suspends the calling fiber instead of blocking the worker. */
+static inline ssize_t fiber_read(int descriptor, void *buffer, size_t count, off_t offset)
+{
+    fiber_io_request_t request = {
+        descriptor, buffer, count, offset, false, 0, 0
+    };
+
+    return _fiber_submit_io(&request);
+}
+
+/* Same as pwrite, but suspends the calling fiber instead of blocking the worker. */
+static inline ssize_t fiber_write(int descriptor, const void *buffer, size_t count, off_t offset)
+{
+    fiber_io_request_t request = {
+        descriptor, (void *) buffer, count, offset, true, 0, 0
+    };
+
+    return _fiber_submit_io(&request);
+}
+
+#endif // FIBER_H
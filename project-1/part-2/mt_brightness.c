@@ -149,6 +149,7 @@ int main(int argc, char* argv[])
     char *destination_file_name = argv[4];
     FILE *source_descriptor = NULL;
     FILE *destination_descriptor = NULL;
+    threadpool_t *threadpool = NULL;
  
     bmp_image image; bmp_init_image_structure(&image);
  
@@ -184,7 +185,7 @@ int main(int argc, char* argv[])
     }
  
     size_t pool_size = utils_get_number_of_cpu_cores();
-    threadpool_t *threadpool = threadpool_create(pool_size);
+    threadpool = threadpool_create(pool_size);
     if (threadpool == NULL) {
         fputs("Failed to create a threadpool.\n", stderr);
         goto cleanup;
@@ -231,7 +232,7 @@ int main(int argc, char* argv[])
             task_data->brightness = brightness;
             task_data->contrast = contrast;
  
-            threadpool_enqueue_task(threadpool, brightness_processing_task, task_data, NULL);
+            threadpool_enqueue_named_task(threadpool, "brightness", brightness_processing_task, task_data, NULL);
         }
  
         while (!exit) { }
@@ -246,6 +247,9 @@ int main(int argc, char* argv[])
     result = EXIT_SUCCESS;
  
 cleanup:
+    /* Also writes the trace of the run when it is built with -DTHREADPOOL_TRACING. */
+    threadpool_destroy(threadpool);
+
     bmp_free_image_structure(&image);
  
     if (source_descriptor != NULL) {
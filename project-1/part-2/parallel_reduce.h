@@ -0,0 +1,250 @@
+#ifndef PARALLEL_REDUCE_H
+#define PARALLEL_REDUCE_H
+
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+    Reduces the range [begin, end) on the pool. Every worker accumulates into
+    its own partial that sits on separate cache lines, so workers never write
+    to shared memory while they process chunks. The partials are merged in a
+    binary tree at the end. As partials are per worker and not per chunk,
+    `merge` has to be commutative and associative.
+
+    `identity` initializes an accumulator, `combine` folds a subrange into one,
+    and `merge` folds the second accumulator into the first.
+
+    Every chunk is combined into an accumulator of its own and then merged
+    into the partial. `combine` may therefore block on the pool (e.g., run a
+    nested reduce): a chunk that the worker picks up meanwhile never sees a
+    half-updated partial.
+*/
+
+#define THREADPOOL_CACHE_LINE_SIZE 64
+
+/* Chunk accumulators up to this size live on the stack of the worker. */
+#define THREADPOOL_REDUCE_STACK_ACCUMULATOR_SIZE 256
+
+/* Merge levels run on the pool only for accumulators this big (e.g., histograms). */
+#define THREADPOOL_REDUCE_PARALLEL_MERGE_SIZE 4096
+
+typedef struct _threadpool_reduce
+{
+    threadpool_t *threadpool;
+
+    uint8_t *partials;
+    size_t partial_stride;
+    size_t accumulator_size;
+
+    void (*identity)(void *accumulator, void *context);
+    void (*combine)(void *accumulator, size_t begin, size_t end, void *context);
+    void (*merge)(void *accumulator, const void *other, void *context);
+    void *context;
+
+    pthread_t caller;
+    pthread_mutex_t foreign_mutex;
+} threadpool_reduce_t;
+
+typedef struct _threadpool_reduce_chunk
+{
+    threadpool_reduce_t *reduce;
+    size_t begin, end;
+} threadpool_reduce_chunk_t;
+
+typedef struct _threadpool_reduce_merge
+{
+    threadpool_reduce_t *reduce;
+    size_t first, second;
+} threadpool_reduce_merge_t;
+
+static inline void *_threadpool_reduce_get_partial(threadpool_reduce_t *reduce, size_t index)
+{
+    return reduce->partials + reduce->partial_stride * index;
+}
+
+static void _threadpool_reduce_chunk_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    threadpool_reduce_chunk_t *chunk = (threadpool_reduce_chunk_t *) task_data;
+    threadpool_reduce_t *reduce = chunk->reduce;
+    threadpool_t *threadpool = reduce->threadpool;
+
+    /* Another outside thread helping in its own sync may pick up our chunk, it shares the last partial. */
+    size_t index = threadpool_get_current_worker_index(threadpool);
+    bool is_foreign = index >= threadpool->thread_count && !pthread_equal(reduce->caller, pthread_self());
+    if (is_foreign) {
+        index = threadpool->thread_count + 1;
+    }
+    uint8_t *partial = _threadpool_reduce_get_partial(reduce, index);
+
+    uint8_t stack_accumulator[THREADPOOL_REDUCE_STACK_ACCUMULATOR_SIZE]
+        __attribute__((aligned(THREADPOOL_CACHE_LINE_SIZE)));
+    uint8_t *accumulator =
+        reduce->accumulator_size <= sizeof(stack_accumulator) ?
+            stack_accumulator : (uint8_t *) malloc(reduce->accumulator_size);
+
+    /* Without memory for an accumulator, `combine` must not block on the pool. */
+    if (NULL == accumulator) {
+        if (is_foreign) {
+            pthread_mutex_lock(&reduce->foreign_mutex);
+        }
+        reduce->combine(partial, chunk->begin, chunk->end, reduce->context);
+        if (is_foreign) {
+            pthread_mutex_unlock(&reduce->foreign_mutex);
+        }
+
+        return;
+    }
+
+    reduce->identity(accumulator, reduce->context);
+    reduce->combine(accumulator, chunk->begin, chunk->end, reduce->context);
+
+    if (is_foreign) {
+        pthread_mutex_lock(&reduce->foreign_mutex);
+    }
+    reduce->merge(partial, accumulator, reduce->context);
+    if (is_foreign) {
+        pthread_mutex_unlock(&reduce->foreign_mutex);
+    }
+
+    if (stack_accumulator != accumulator) {
+        free(accumulator);
+    }
+}
+
+static void _threadpool_reduce_merge_task(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    threadpool_reduce_merge_t *merge = (threadpool_reduce_merge_t *) task_data;
+    threadpool_reduce_t *reduce = merge->reduce;
+
+    reduce->merge(
+        _threadpool_reduce_get_partial(reduce, merge->first),
+        _threadpool_reduce_get_partial(reduce, merge->second),
+        reduce->context
+    );
+}
+
+static void *threadpool_parallel_reduce(
+                 threadpool_t *threadpool,
+                 size_t begin, size_t end, size_t grain_size,
+                 void *result, size_t accumulator_size,
+                 void (*identity)(void *accumulator, void *context),
+                 void (*combine)(void *accumulator, size_t begin, size_t end, void *context),
+                 void (*merge)(void *accumulator, const void *other, void *context),
+                 void *context
+             )
+{
+    /* One partial per worker, one for the caller, and one for foreign helpers. */
+    size_t partial_count = threadpool->thread_count + 2;
+
+    threadpool_reduce_t reduce;
+    reduce.threadpool = threadpool;
+    reduce.accumulator_size = accumulator_size;
+    reduce.partial_stride =
+        ((accumulator_size - 1) / THREADPOOL_CACHE_LINE_SIZE + 1) * THREADPOOL_CACHE_LINE_SIZE;
+    reduce.identity = identity;
+    reduce.combine = combine;
+    reduce.merge = merge;
+    reduce.context = context;
+    reduce.caller = pthread_self();
+
+    identity(result, context);
+    if (begin >= end) {
+        return result;
+    }
+
+    size_t range_size = end - begin;
+    if (0 == grain_size) {
+        /* A pool without threads is still served by the caller helping in its sync. */
+        size_t worker_count = 0 == threadpool->thread_count ? 1 : threadpool->thread_count;
+        grain_size = range_size / (worker_count * 4);
+        if (0 == grain_size) {
+            grain_size = 1;
+        }
+    }
+    size_t chunk_count = (range_size - 1) / grain_size + 1;
+
+    void *partials = NULL;
+    if (0 != posix_memalign(&partials, THREADPOOL_CACHE_LINE_SIZE, reduce.partial_stride * partial_count)) {
+        return NULL;
+    }
+    reduce.partials = (uint8_t *) partials;
+
+    threadpool_reduce_chunk_t *chunks =
+        (threadpool_reduce_chunk_t *) malloc(sizeof(*chunks) * chunk_count);
+    threadpool_reduce_merge_t *merges =
+        (threadpool_reduce_merge_t *) malloc(sizeof(*merges) * partial_count);
+    if (NULL == chunks || NULL == merges) {
+        free(chunks);
+        free(merges);
+        free(partials);
+
+        return NULL;
+    }
+
+    if (0 != pthread_mutex_init(&reduce.foreign_mutex, NULL)) {
+        free(chunks);
+        free(merges);
+        free(partials);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < partial_count; ++i) {
+        identity(_threadpool_reduce_get_partial(&reduce, i), context);
+    }
+
+    task_group_t group;
+    task_group_init(&group);
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        threadpool_reduce_chunk_t *chunk = &chunks[i];
+        chunk->reduce = &reduce;
+        chunk->begin = begin + i * grain_size;
+        chunk->end = chunk->begin + grain_size > end ? end : chunk->begin + grain_size;
+
+        if (NULL == threadpool_spawn(threadpool, &group, _threadpool_reduce_chunk_task, chunk, NULL)) {
+            _threadpool_reduce_chunk_task(chunk, NULL);
+        }
+    }
+    threadpool_sync(threadpool, &group);
+
+    bool is_parallel_merge = accumulator_size >= THREADPOOL_REDUCE_PARALLEL_MERGE_SIZE;
+    for (size_t stride = 1; stride < partial_count; stride *= 2) {
+        size_t merge_count = 0;
+        for (size_t i = 0; i + stride < partial_count; i += stride * 2) {
+            threadpool_reduce_merge_t *merge_data = &merges[merge_count++];
+            merge_data->reduce = &reduce;
+            merge_data->first = i;
+            merge_data->second = i + stride;
+
+            if (!is_parallel_merge ||
+                    NULL == threadpool_spawn(threadpool, &group, _threadpool_reduce_merge_task, merge_data, NULL)) {
+                _threadpool_reduce_merge_task(merge_data, NULL);
+            }
+        }
+        threadpool_sync(threadpool, &group);
+    }
+
+    memcpy(result, _threadpool_reduce_get_partial(&reduce, 0), accumulator_size);
+
+    pthread_mutex_destroy(&reduce.foreign_mutex);
+    free(merges);
+    free(chunks);
+    free(partials);
+
+    return result;
+}
+
+#endif // PARALLEL_REDUCE_H
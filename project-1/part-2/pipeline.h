@@ -0,0 +1,597 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "sync_queue.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+    A pipeline is a chain of stages connected by bounded queues. Every stage
+    runs `parallelism` threads that take items from the stage's input queue,
+    transform them, and pass the results to the next stage. When a queue is
+    full, the upstream stage (or `pipeline_push`) blocks, so a fast producer
+    can never get more than `queue_depth` items ahead of a slow consumer.
+
+    An ordered stage emits its results in the order the items were pushed into
+    the pipeline. Its workers only start on items within `queue_depth` of the
+    next item to emit, so the results waiting to be reordered stay bounded as
+    well. Results of the last stage are taken with `pipeline_pop`. A stage
+    function may return NULL to drop an item.
+*/
+
+/* Pipeline Token */
+
+typedef struct _pipeline_token
+{
+    void *data;
+    size_t sequence;
+    bool is_end;
+
+    struct _pipeline_token *next;
+} pipeline_token_t;
+
+static inline pipeline_token_t *pipeline_token_create(void *data, size_t sequence, bool is_end)
+{
+    pipeline_token_t *token = (pipeline_token_t *) malloc(sizeof(*token));
+    if (NULL == token) {
+        return token;
+    }
+
+    token->data = data;
+    token->sequence = sequence;
+    token->is_end = is_end;
+    token->next = NULL;
+
+    return token;
+}
+
+static inline void pipeline_token_destroy(pipeline_token_t *token)
+{
+    if (NULL != token) {
+        free(token);
+    }
+}
+
+/* Pipeline Stage */
+
+typedef struct _pipeline pipeline_t;
+
+typedef struct _pipeline_stage
+{
+    pipeline_t *pipeline;
+    size_t index;
+
+    void *(*function)(void *item, void *stage_data);
+    void *stage_data;
+
+    size_t parallelism;
+    size_t queue_depth;
+    bool is_ordered;
+
+    sync_queue_t *input;
+    pthread_t *threads;
+    size_t threads_started;
+    volatile ssize_t workers_left;
+
+    /* End tokens for the workers of this stage, allocated up front so that closing cannot fail. */
+    pipeline_token_t **end_tokens;
+
+    pthread_mutex_t order_mutex;
+    pthread_cond_t order_condition;
+    pipeline_token_t *pending_tokens;
+    size_t next_sequence;
+    size_t waiting_workers;
+    bool is_emitting;
+} pipeline_stage_t;
+
+/* Pipeline */
+
+struct _pipeline
+{
+    pipeline_stage_t **stages;
+    size_t stage_count;
+    size_t stage_capacity;
+
+    sync_queue_t *output;
+    size_t output_depth;
+    pipeline_token_t *end_token;
+    bool is_drained;
+
+    volatile size_t next_sequence;
+};
+
+static inline pipeline_t *pipeline_allocate(void)
+{
+    return (pipeline_t *) malloc(sizeof(pipeline_t));
+}
+
+static inline pipeline_t *pipeline_init(pipeline_t *pipeline, size_t output_depth)
+{
+    pipeline->stages = NULL;
+    pipeline->stage_count = 0;
+    pipeline->stage_capacity = 0;
+
+    pipeline->output = NULL;
+    pipeline->output_depth = output_depth;
+    pipeline->end_token = NULL;
+    pipeline->is_drained = false;
+
+    pipeline->next_sequence = 0;
+
+    return pipeline;
+}
+
+static inline pipeline_t *pipeline_create(size_t output_depth)
+{
+    pipeline_t *pipeline = pipeline_allocate();
+    if (NULL == pipeline) {
+        return pipeline;
+    }
+
+    return pipeline_init(pipeline, output_depth);
+}
+
+static void _pipeline_destroy_tokens(void *element)
+{
+    pipeline_token_destroy((pipeline_token_t *) element);
+}
+
+static void _pipeline_stage_destroy(pipeline_stage_t *stage)
+{
+    if (NULL == stage) {
+        return;
+    }
+
+    if (NULL != stage->input) {
+        sync_queue_destroy_with_elements(stage->input, _pipeline_destroy_tokens);
+        stage->input = NULL;
+    }
+
+    for (pipeline_token_t *token = stage->pending_tokens; NULL != token;) {
+        pipeline_token_t *next = token->next;
+        pipeline_token_destroy(token);
+        token = next;
+    }
+    stage->pending_tokens = NULL;
+
+    if (NULL != stage->end_tokens) {
+        for (size_t i = 0; i < stage->parallelism; ++i) {
+            pipeline_token_destroy(stage->end_tokens[i]);
+        }
+
+        free(stage->end_tokens);
+        stage->end_tokens = NULL;
+    }
+
+    free(stage->threads);
+    stage->threads = NULL;
+
+    pthread_cond_destroy(&stage->order_condition);
+    pthread_mutex_destroy(&stage->order_mutex);
+
+    free(stage);
+}
+
+static void pipeline_destroy(pipeline_t *pipeline)
+{
+    if (NULL == pipeline) {
+        return;
+    }
+
+    if (NULL != pipeline->stages) {
+        for (size_t i = 0; i < pipeline->stage_count; ++i) {
+            _pipeline_stage_destroy(pipeline->stages[i]);
+        }
+
+        free(pipeline->stages);
+        pipeline->stages = NULL;
+    }
+
+    if (NULL != pipeline->output) {
+        sync_queue_destroy_with_elements(pipeline->output, _pipeline_destroy_tokens);
+        pipeline->output = NULL;
+    }
+
+    pipeline_token_destroy(pipeline->end_token);
+    pipeline->end_token = NULL;
+
+    free(pipeline);
+}
+
+static pipeline_stage_t *pipeline_add_stage(
+                             pipeline_t *pipeline,
+                             void *(*function)(void *item, void *stage_data),
+                             void *stage_data,
+                             size_t parallelism,
+                             size_t queue_depth,
+                             bool is_ordered
+                         )
+{
+    if (pipeline->stage_count == pipeline->stage_capacity) {
+        size_t capacity =
+            0 == pipeline->stage_capacity ?
+                4 : pipeline->stage_capacity * 2;
+
+        pipeline_stage_t **stages =
+            (pipeline_stage_t **) realloc(pipeline->stages, sizeof(*stages) * capacity);
+        if (NULL == stages) {
+            return NULL;
+        }
+
+        pipeline->stages = stages;
+        pipeline->stage_capacity = capacity;
+    }
+
+    pipeline_stage_t *stage = (pipeline_stage_t *) malloc(sizeof(*stage));
+    if (NULL == stage) {
+        return stage;
+    }
+
+    stage->pipeline = pipeline;
+    stage->index = pipeline->stage_count;
+
+    stage->function = function;
+    stage->stage_data = stage_data;
+
+    stage->parallelism = 0 == parallelism ? 1 : parallelism;
+    stage->queue_depth = queue_depth;
+    stage->is_ordered = is_ordered;
+
+    stage->input = NULL;
+    stage->threads = NULL;
+    stage->threads_started = 0;
+    stage->workers_left = 0;
+
+    stage->end_tokens = NULL;
+
+    stage->pending_tokens = NULL;
+    stage->next_sequence = 0;
+    stage->waiting_workers = 0;
+    stage->is_emitting = false;
+
+    if (0 != pthread_mutex_init(&stage->order_mutex, NULL)) {
+        free(stage);
+
+        return NULL;
+    }
+
+    if (0 != pthread_cond_init(&stage->order_condition, NULL)) {
+        pthread_mutex_destroy(&stage->order_mutex);
+        free(stage);
+
+        return NULL;
+    }
+
+    pipeline->stages[pipeline->stage_count++] = stage;
+
+    return stage;
+}
+
+static inline sync_queue_t *_pipeline_stage_get_output(pipeline_stage_t *stage)
+{
+    pipeline_t *pipeline = stage->pipeline;
+
+    return stage->index + 1 < pipeline->stage_count ?
+               pipeline->stages[stage->index + 1]->input :
+               pipeline->output;
+}
+
+static void _pipeline_stage_forward(pipeline_stage_t *stage, pipeline_token_t *token)
+{
+    pipeline_t *pipeline = stage->pipeline;
+
+    /* Dropped items keep travelling so that ordered stages see no gaps. */
+    if (NULL == token->data && stage->index + 1 == pipeline->stage_count) {
+        pipeline_token_destroy(token);
+
+        return;
+    }
+
+    if (NULL == sync_queue_enqueue(_pipeline_stage_get_output(stage), token)) {
+        pipeline_token_destroy(token);
+    }
+}
+
+/* Hands the preallocated end tokens over to a queue, each of them only once. */
+static void _pipeline_send_end_tokens(sync_queue_t *queue, pipeline_token_t **tokens, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        pipeline_token_t *token = tokens[i];
+        if (NULL == token) {
+            continue;
+        }
+        tokens[i] = NULL;
+
+        if (NULL == sync_queue_enqueue(queue, token)) {
+            pipeline_token_destroy(token);
+        }
+    }
+}
+
+/* Every worker of the next stage (or the consumer) has to see its own end token. */
+static void _pipeline_stage_close_output(pipeline_stage_t *stage)
+{
+    pipeline_t *pipeline = stage->pipeline;
+
+    if (stage->index + 1 < pipeline->stage_count) {
+        pipeline_stage_t *next_stage = pipeline->stages[stage->index + 1];
+        _pipeline_send_end_tokens(next_stage->input, next_stage->end_tokens, next_stage->parallelism);
+    } else {
+        _pipeline_send_end_tokens(pipeline->output, &pipeline->end_token, 1);
+    }
+}
+
+/*
+    Holds a worker of an ordered stage back while its item is `queue_depth` or
+    more items ahead of the next one to emit. The last worker that is not
+    waiting always goes on, since the item everybody waits for may still be
+    stuck upstream behind the stage's full input queue.
+*/
+static void _pipeline_stage_wait_for_window(pipeline_stage_t *stage, const pipeline_token_t *token)
+{
+    if (0 == stage->queue_depth) {
+        return;
+    }
+
+    pthread_mutex_lock(&stage->order_mutex);
+    while (token->sequence >= stage->next_sequence + stage->queue_depth &&
+               stage->waiting_workers + 1 < stage->parallelism) {
+        stage->waiting_workers += 1;
+        pthread_cond_wait(&stage->order_condition, &stage->order_mutex);
+        stage->waiting_workers -= 1;
+    }
+    pthread_mutex_unlock(&stage->order_mutex);
+}
+
+static void _pipeline_stage_emit_ordered(pipeline_stage_t *stage, pipeline_token_t *token)
+{
+    pthread_mutex_lock(&stage->order_mutex);
+
+    pipeline_token_t **position = &stage->pending_tokens;
+    while (NULL != *position && (*position)->sequence < token->sequence) {
+        position = &(*position)->next;
+    }
+    token->next = *position;
+    *position = token;
+
+    /* Only one worker at a time moves the contiguous head of the list downstream. */
+    if (stage->is_emitting) {
+        pthread_mutex_unlock(&stage->order_mutex);
+
+        return;
+    }
+    stage->is_emitting = true;
+
+    while (NULL != stage->pending_tokens &&
+               stage->pending_tokens->sequence == stage->next_sequence) {
+        pipeline_token_t *ready_token = stage->pending_tokens;
+        stage->pending_tokens = ready_token->next;
+        ready_token->next = NULL;
+        stage->next_sequence += 1;
+        pthread_cond_broadcast(&stage->order_condition);
+
+        pthread_mutex_unlock(&stage->order_mutex);
+        _pipeline_stage_forward(stage, ready_token);
+        pthread_mutex_lock(&stage->order_mutex);
+    }
+
+    stage->is_emitting = false;
+    pthread_mutex_unlock(&stage->order_mutex);
+}
+
+static void *_pipeline_stage_start(void *args)
+{
+    pipeline_stage_t *stage = (pipeline_stage_t *) args;
+
+    while (true) {
+        pipeline_token_t *token = (pipeline_token_t *) sync_queue_deque(stage->input);
+        if (NULL == token) {
+            continue;
+        }
+
+        if (token->is_end) {
+            pipeline_token_destroy(token);
+            break;
+        }
+
+        if (stage->is_ordered) {
+            _pipeline_stage_wait_for_window(stage, token);
+        }
+
+        if (NULL != token->data) {
+            token->data = stage->function(token->data, stage->stage_data);
+        }
+
+        if (stage->is_ordered) {
+            _pipeline_stage_emit_ordered(stage, token);
+        } else {
+            _pipeline_stage_forward(stage, token);
+        }
+    }
+
+    if (0 == __sync_sub_and_fetch(&stage->workers_left, 1)) {
+        _pipeline_stage_close_output(stage);
+    }
+
+    return NULL;
+}
+
+/*
+    Stops the threads that a failed `pipeline_start` managed to create. Every
+    started worker gets an end token of its own, last stage first, so that no
+    stage passes tokens on to a stage that is being stopped at the same time.
+    The remaining end tokens are freed, so the chained closing sends nothing.
+*/
+static void _pipeline_stop_started_threads(pipeline_t *pipeline)
+{
+    for (size_t i = 0; i < pipeline->stage_count; ++i) {
+        pipeline_stage_t *stage = pipeline->stages[i];
+
+        for (size_t j = stage->threads_started; j < stage->parallelism; ++j) {
+            pipeline_token_destroy(stage->end_tokens[j]);
+            stage->end_tokens[j] = NULL;
+        }
+    }
+
+    for (size_t i = pipeline->stage_count; i > 0; --i) {
+        pipeline_stage_t *stage = pipeline->stages[i - 1];
+
+        _pipeline_send_end_tokens(stage->input, stage->end_tokens, stage->threads_started);
+    }
+
+    for (size_t i = 0; i < pipeline->stage_count; ++i) {
+        pipeline_stage_t *stage = pipeline->stages[i];
+
+        for (size_t j = 0; j < stage->threads_started; ++j) {
+            pthread_join(stage->threads[j], NULL);
+        }
+        stage->threads_started = 0;
+    }
+}
+
+/*
+    Creates the queues and starts the threads of all stages. On failure, it
+    returns NULL with every thread it started already joined, so the only
+    thing left to do with the pipeline is `pipeline_destroy`.
+*/
+static pipeline_t *pipeline_start(pipeline_t *pipeline)
+{
+    if (0 == pipeline->stage_count) {
+        return NULL;
+    }
+
+    pipeline->output = sync_queue_create_bounded(pipeline->output_depth);
+    if (NULL == pipeline->output) {
+        return NULL;
+    }
+
+    pipeline->end_token = pipeline_token_create(NULL, 0, true);
+    if (NULL == pipeline->end_token) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pipeline->stage_count; ++i) {
+        pipeline_stage_t *stage = pipeline->stages[i];
+
+        stage->input = sync_queue_create_bounded(stage->queue_depth);
+        if (NULL == stage->input) {
+            return NULL;
+        }
+
+        stage->threads = (pthread_t *) malloc(sizeof(pthread_t) * stage->parallelism);
+        if (NULL == stage->threads) {
+            return NULL;
+        }
+
+        stage->end_tokens = (pipeline_token_t **) calloc(stage->parallelism, sizeof(*stage->end_tokens));
+        if (NULL == stage->end_tokens) {
+            return NULL;
+        }
+
+        for (size_t j = 0; j < stage->parallelism; ++j) {
+            stage->end_tokens[j] = pipeline_token_create(NULL, 0, true);
+            if (NULL == stage->end_tokens[j]) {
+                return NULL;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < pipeline->stage_count; ++i) {
+        pipeline_stage_t *stage = pipeline->stages[i];
+
+        stage->workers_left = (ssize_t) stage->parallelism;
+        for (size_t j = 0; j < stage->parallelism; ++j) {
+            if (0 != pthread_create(&stage->threads[j], NULL, _pipeline_stage_start, stage)) {
+                /* No worker has seen an end token yet, so nobody reads the count concurrently. */
+                stage->workers_left = (ssize_t) stage->threads_started;
+                _pipeline_stop_started_threads(pipeline);
+
+                return NULL;
+            }
+            stage->threads_started += 1;
+        }
+    }
+
+    return pipeline;
+}
+
+/* Blocks while the first stage's queue is full. */
+static pipeline_t *pipeline_push(pipeline_t *pipeline, void *item)
+{
+    if (NULL == item) {
+        return NULL;
+    }
+
+    size_t sequence = __sync_fetch_and_add(&pipeline->next_sequence, 1);
+
+    pipeline_token_t *token = pipeline_token_create(item, sequence, false);
+    if (NULL == token) {
+        return NULL;
+    }
+
+    if (NULL == sync_queue_enqueue(pipeline->stages[0]->input, token)) {
+        pipeline_token_destroy(token);
+
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/* Signals that no more items will be pushed. */
+static void pipeline_close(pipeline_t *pipeline)
+{
+    pipeline_stage_t *first_stage = pipeline->stages[0];
+
+    _pipeline_send_end_tokens(first_stage->input, first_stage->end_tokens, first_stage->parallelism);
+}
+
+/* Returns the next result of the last stage or NULL when the pipeline is drained. */
+static void *pipeline_pop(pipeline_t *pipeline)
+{
+    while (!pipeline->is_drained) {
+        pipeline_token_t *token = (pipeline_token_t *) sync_queue_deque(pipeline->output);
+        if (NULL == token) {
+            continue;
+        }
+
+        if (token->is_end) {
+            pipeline->is_drained = true;
+            pipeline_token_destroy(token);
+
+            break;
+        }
+
+        void *data = token->data;
+        pipeline_token_destroy(token);
+
+        if (NULL != data) {
+            return data;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Waits for all stage threads to finish. Results of the last stage have to be
+    drained with `pipeline_pop` first, otherwise a full output queue blocks the
+    last stage forever.
+*/
+static void pipeline_wait(pipeline_t *pipeline)
+{
+    for (size_t i = 0; i < pipeline->stage_count; ++i) {
+        pipeline_stage_t *stage = pipeline->stages[i];
+
+        for (size_t j = 0; j < stage->threads_started; ++j) {
+            pthread_join(stage->threads[j], NULL);
+        }
+        stage->threads_started = 0;
+    }
+}
+
+#endif // PIPELINE_H
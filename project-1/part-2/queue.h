@@ -199,7 +199,10 @@ static void *queue_deque(queue_t *queue)
             queue->size -= 1;
 
             if (0 == queue->size) {
+                queue->first = NULL;
                 queue->last = NULL;
+            } else {
+                queue->first->previous = NULL;
             }
 
             result = item->content;
@@ -223,6 +226,9 @@ static void *queue_pop(queue_t *queue)
 
             if (0 == queue->size) {
                 queue->first = NULL;
+                queue->last = NULL;
+            } else {
+                queue->last->next = NULL;
             }
 
             result = item->content;
@@ -3,16 +3,48 @@
 
 #include "queue.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/types.h>
+
+/*
+    A synchronized queue consists of one or more lanes. Every lane has its own
+    order (LIFO or FIFO) and weight. When several lanes have elements, they are
+    served in a smooth weighted round-robin, i.e., a lane with weight 4 gets
+    four elements taken for every element of a lane with weight 1, and the
+    picks are interleaved rather than bunched together.
+*/
+
+#define SYNC_QUEUE_MAX_LANES 4
+
+typedef enum _sync_queue_policy
+{
+    SYNC_QUEUE_POLICY_LIFO,
+    SYNC_QUEUE_POLICY_FIFO
+} sync_queue_policy_t;
+
+typedef struct _sync_queue_lane
+{
+    queue_t implementation;
+    sync_queue_policy_t policy;
+    size_t weight;
+    ssize_t credit;
+} sync_queue_lane_t;
 
 typedef struct _sync_queue
 {
     pthread_mutex_t access_mutex;
     pthread_cond_t not_empty_condition;
-    queue_t implementation;
+    pthread_cond_t not_full_condition;
+    size_t capacity;
+    size_t size;
+    bool is_closed;
+
+    sync_queue_lane_t lanes[SYNC_QUEUE_MAX_LANES];
+    size_t lane_count;
 } sync_queue_t;
 
 static inline sync_queue_t *sync_queue_allocate()
@@ -20,7 +52,8 @@ static inline sync_queue_t *sync_queue_allocate()
     return (sync_queue_t *) malloc(sizeof(sync_queue_t));
 }
 
-static inline sync_queue_t *sync_queue_init(sync_queue_t *queue)
+/* A capacity of zero makes the queue unbounded. */
+static inline sync_queue_t *sync_queue_init_bounded(sync_queue_t *queue, size_t capacity)
 {
     if (0 != pthread_mutex_init(&queue->access_mutex, NULL)) {
         return NULL;
@@ -31,19 +64,44 @@ static inline sync_queue_t *sync_queue_init(sync_queue_t *queue)
 
         return NULL;
     }
-    queue_init(&queue->implementation);
+
+    if (0 != pthread_cond_init(&queue->not_full_condition, NULL)) {
+        pthread_cond_destroy(&queue->not_empty_condition);
+        pthread_mutex_destroy(&queue->access_mutex);
+
+        return NULL;
+    }
+
+    queue->capacity = capacity;
+    queue->size = 0;
+    queue->is_closed = false;
+
+    for (size_t i = 0; i < SYNC_QUEUE_MAX_LANES; ++i) {
+        sync_queue_lane_t *lane = &queue->lanes[i];
+
+        queue_init(&lane->implementation);
+        lane->policy = SYNC_QUEUE_POLICY_LIFO;
+        lane->weight = 1;
+        lane->credit = 0;
+    }
+    queue->lane_count = 1;
 
     return queue;
 }
 
-static inline sync_queue_t *sync_queue_create()
+static inline sync_queue_t *sync_queue_init(sync_queue_t *queue)
+{
+    return sync_queue_init_bounded(queue, 0);
+}
+
+static inline sync_queue_t *sync_queue_create_bounded(size_t capacity)
 {
     sync_queue_t *queue = sync_queue_allocate();
     if (NULL == queue) {
         return queue;
     }
 
-    if (NULL == sync_queue_init(queue)) {
+    if (NULL == sync_queue_init_bounded(queue, capacity)) {
         free(queue);
 
         return NULL;
@@ -52,7 +110,15 @@ static inline sync_queue_t *sync_queue_create()
     return queue;
 }
 
-static inline void sync_queue_destroy(sync_queue_t *queue)
+static inline sync_queue_t *sync_queue_create()
+{
+    return sync_queue_create_bounded(0);
+}
+
+static inline void sync_queue_destroy_with_elements(
+                       sync_queue_t *queue,
+                       queue_destroy_element_callback destroy_element_callback
+                   )
 {
     if (NULL == queue) {
         return;
@@ -60,28 +126,112 @@ static inline void sync_queue_destroy(sync_queue_t *queue)
 
     pthread_mutex_destroy(&queue->access_mutex);
     pthread_cond_destroy(&queue->not_empty_condition);
-    queue_destroy(&queue->implementation);
+    pthread_cond_destroy(&queue->not_full_condition);
+
+    for (size_t i = 0; i < SYNC_QUEUE_MAX_LANES; ++i) {
+        if (NULL != destroy_element_callback) {
+            queue_deinit_with_elements(&queue->lanes[i].implementation, destroy_element_callback);
+        } else {
+            queue_deinit(&queue->lanes[i].implementation);
+        }
+    }
+
     free(queue);
 }
 
+static inline void sync_queue_destroy(sync_queue_t *queue)
+{
+    sync_queue_destroy_with_elements(queue, NULL);
+}
+
+/* Lanes are configured before the queue is shared between threads. */
+static inline sync_queue_t *sync_queue_set_lane(
+                               sync_queue_t *queue,
+                               size_t lane,
+                               size_t weight,
+                               sync_queue_policy_t policy
+                           )
+{
+    if (lane >= SYNC_QUEUE_MAX_LANES) {
+        return NULL;
+    }
+
+    queue->lanes[lane].weight = 0 == weight ? 1 : weight;
+    queue->lanes[lane].policy = policy;
+    if (lane >= queue->lane_count) {
+        queue->lane_count = lane + 1;
+    }
+
+    return queue;
+}
+
+/* Can be called without the lock to peek at the queue (e.g., while spinning). */
 static inline size_t sync_queue_get_size(sync_queue_t *queue)
 {
-    return (size_t) queue_get_size(&queue->implementation);
+    return *(volatile size_t *) &queue->size;
 }
 
 static inline bool sync_queue_is_empty(sync_queue_t *queue)
 {
-    return queue_is_empty(&queue->implementation);
+    return 0 == sync_queue_get_size(queue);
 }
 
-static sync_queue_t *sync_queue_enqueue(sync_queue_t *queue, void *data)
+static inline bool sync_queue_is_closed(sync_queue_t *queue)
 {
+    return *(volatile bool *) &queue->is_closed;
+}
+
+/*
+    Wakes up all consumers and producers. Once a closed queue is empty, taking
+    from it returns NULL instead of waiting, and adding to it fails right away.
+*/
+static void sync_queue_close(sync_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->access_mutex);
+    queue->is_closed = true;
+    pthread_cond_broadcast(&queue->not_empty_condition);
+    pthread_cond_broadcast(&queue->not_full_condition);
+    pthread_mutex_unlock(&queue->access_mutex);
+}
+
+static inline bool _sync_queue_is_full(sync_queue_t *queue)
+{
+    return 0 != queue->capacity && queue->size >= queue->capacity;
+}
+
+/* Blocks while a bounded queue is full. Fails with NULL once the queue is closed. */
+static sync_queue_t *sync_queue_enqueue_to_lane(sync_queue_t *queue, void *data, size_t lane)
+{
+    /* The underlying queue ignores NULL elements. */
+    if (NULL == data) {
+        return NULL;
+    }
+
+    if (lane >= queue->lane_count) {
+        lane = queue->lane_count - 1;
+    }
+
     if (0 != pthread_mutex_lock(&queue->access_mutex)) {
         return NULL;
     }
 
-    queue_push(&queue->implementation, data);
-    pthread_cond_broadcast(&queue->not_empty_condition);
+    while (_sync_queue_is_full(queue) && !queue->is_closed) {
+        if (0 != pthread_cond_wait(&queue->not_full_condition, &queue->access_mutex)) {
+            pthread_mutex_unlock(&queue->access_mutex);
+
+            return NULL;
+        }
+    }
+
+    if (queue->is_closed) {
+        pthread_mutex_unlock(&queue->access_mutex);
+
+        return NULL;
+    }
+
+    queue_push(&queue->lanes[lane].implementation, data);
+    queue->size += 1;
+    pthread_cond_signal(&queue->not_empty_condition);
 
     if (0 != pthread_mutex_unlock(&queue->access_mutex)) {
         return NULL;
@@ -90,7 +240,60 @@ static sync_queue_t *sync_queue_enqueue(sync_queue_t *queue, void *data)
     return queue;
 }
 
-static void *sync_queue_pop(sync_queue_t *queue)
+static inline sync_queue_t *sync_queue_enqueue(sync_queue_t *queue, void *data)
+{
+    return sync_queue_enqueue_to_lane(queue, data, 0);
+}
+
+static sync_queue_lane_t *_sync_queue_select_lane(sync_queue_t *queue)
+{
+    sync_queue_lane_t *selected_lane = NULL;
+    ssize_t total_weight = 0;
+
+    for (size_t i = 0; i < queue->lane_count; ++i) {
+        sync_queue_lane_t *lane = &queue->lanes[i];
+        if (queue_is_empty(&lane->implementation)) {
+            continue;
+        }
+
+        lane->credit += (ssize_t) lane->weight;
+        total_weight += (ssize_t) lane->weight;
+
+        if (NULL == selected_lane || lane->credit > selected_lane->credit) {
+            selected_lane = lane;
+        }
+    }
+
+    if (NULL != selected_lane) {
+        selected_lane->credit -= total_weight;
+    }
+
+    return selected_lane;
+}
+
+/* Must be called with the access mutex held. */
+static void *_sync_queue_take_locked(sync_queue_t *queue, const sync_queue_policy_t *order)
+{
+    sync_queue_lane_t *lane = _sync_queue_select_lane(queue);
+    if (NULL == lane) {
+        return NULL;
+    }
+
+    sync_queue_policy_t policy = NULL != order ? *order : lane->policy;
+    void *data =
+        SYNC_QUEUE_POLICY_FIFO == policy ?
+            queue_deque(&lane->implementation) :
+            queue_pop(&lane->implementation);
+
+    queue->size -= 1;
+    if (0 != queue->capacity) {
+        pthread_cond_signal(&queue->not_full_condition);
+    }
+
+    return data;
+}
+
+static void *_sync_queue_take(sync_queue_t *queue, const sync_queue_policy_t *order)
 {
     void *data = NULL;
 
@@ -98,13 +301,19 @@ static void *sync_queue_pop(sync_queue_t *queue)
         return data;
     }
 
-    while (queue_is_empty(&queue->implementation)) {
+    while (0 == queue->size) {
+        if (queue->is_closed) {
+            pthread_mutex_unlock(&queue->access_mutex);
+
+            return data;
+        }
+
         if (0 != pthread_cond_wait(&queue->not_empty_condition, &queue->access_mutex)) {
             return data;
         }
     }
 
-    data = queue_pop(&queue->implementation);
+    data = _sync_queue_take_locked(queue, order);
 
     if (0 != pthread_mutex_unlock(&queue->access_mutex)) {
         return data;
@@ -113,4 +322,42 @@ static void *sync_queue_pop(sync_queue_t *queue)
     return data;
 }
 
+/* Returns NULL instead of waiting when the queue is empty. */
+static void *sync_queue_try_take(sync_queue_t *queue)
+{
+    void *data = NULL;
+
+    if (0 != pthread_mutex_lock(&queue->access_mutex)) {
+        return data;
+    }
+
+    data = _sync_queue_take_locked(queue, NULL);
+
+    pthread_mutex_unlock(&queue->access_mutex);
+
+    return data;
+}
+
+/* Takes an element from the next lane in the order of that lane's policy. */
+static inline void *sync_queue_take(sync_queue_t *queue)
+{
+    return _sync_queue_take(queue, NULL);
+}
+
+/* Takes the most recently added element of the next lane. */
+static inline void *sync_queue_pop(sync_queue_t *queue)
+{
+    static const sync_queue_policy_t Order = SYNC_QUEUE_POLICY_LIFO;
+
+    return _sync_queue_take(queue, &Order);
+}
+
+/* Takes the oldest element of the next lane. */
+static inline void *sync_queue_deque(sync_queue_t *queue)
+{
+    static const sync_queue_policy_t Order = SYNC_QUEUE_POLICY_FIFO;
+
+    return _sync_queue_take(queue, &Order);
+}
+
 #endif // SYNC_QUEUE_H
@@ -0,0 +1,372 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+    A task graph is a set of pool tasks connected by "happens before" edges.
+    Every node keeps an atomic counter of unfinished predecessors. When a node
+    completes, it decrements the counters of its successors. The first
+    successor that becomes ready is executed right away on the same worker
+    (its input is most likely still in that core's cache), the rest are
+    enqueued to the pool.
+*/
+
+typedef struct _task_graph task_graph_t;
+
+/* Task Graph Node */
+
+typedef struct _task_graph_node
+{
+    void (*task)(void *task_data, void (*result_callback)(void *result));
+    void *task_data;
+    void (*result_callback)(void *result);
+
+    struct _task_graph_node **successors;
+    size_t successor_count;
+    size_t successor_capacity;
+
+    size_t predecessor_count;
+    volatile ssize_t predecessors_left;
+
+    task_graph_t *graph;
+} task_graph_node_t;
+
+static inline task_graph_node_t *task_graph_node_create(
+                                     task_graph_t *graph,
+                                     void (*task)(void *task_data, void (*result_callback)(void *result)),
+                                     void *task_data,
+                                     void (*result_callback)(void *result)
+                                 )
+{
+    task_graph_node_t *node = (task_graph_node_t *) malloc(sizeof(*node));
+    if (NULL == node) {
+        return node;
+    }
+
+    node->task = task;
+    node->task_data = task_data;
+    node->result_callback = result_callback;
+
+    node->successors = NULL;
+    node->successor_count = 0;
+    node->successor_capacity = 0;
+
+    node->predecessor_count = 0;
+    node->predecessors_left = 0;
+
+    node->graph = graph;
+
+    return node;
+}
+
+static inline void task_graph_node_destroy(task_graph_node_t *node)
+{
+    if (NULL != node) {
+        free(node->successors);
+        free(node);
+    }
+}
+
+/* Task Graph */
+
+struct _task_graph
+{
+    threadpool_t *threadpool;
+
+    task_graph_node_t **nodes;
+    size_t node_count;
+    size_t node_capacity;
+
+    volatile ssize_t nodes_left;
+    bool is_complete;
+    pthread_mutex_t completion_mutex;
+    pthread_cond_t completion_condition;
+};
+
+static inline task_graph_t *task_graph_allocate(void)
+{
+    return (task_graph_t *) malloc(sizeof(task_graph_t));
+}
+
+static task_graph_t *task_graph_init(task_graph_t *graph, threadpool_t *threadpool)
+{
+    graph->threadpool = threadpool;
+
+    graph->nodes = NULL;
+    graph->node_count = 0;
+    graph->node_capacity = 0;
+
+    graph->nodes_left = 0;
+    graph->is_complete = true;
+
+    if (0 != pthread_mutex_init(&graph->completion_mutex, NULL)) {
+        return NULL;
+    }
+
+    if (0 != pthread_cond_init(&graph->completion_condition, NULL)) {
+        pthread_mutex_destroy(&graph->completion_mutex);
+
+        return NULL;
+    }
+
+    return graph;
+}
+
+static inline task_graph_t *task_graph_create(threadpool_t *threadpool)
+{
+    task_graph_t *graph = task_graph_allocate();
+    if (NULL == graph) {
+        return graph;
+    }
+
+    if (NULL == task_graph_init(graph, threadpool)) {
+        free(graph);
+
+        return NULL;
+    }
+
+    return graph;
+}
+
+static void task_graph_destroy(task_graph_t *graph)
+{
+    if (NULL == graph) {
+        return;
+    }
+
+    if (NULL != graph->nodes) {
+        for (size_t i = 0; i < graph->node_count; ++i) {
+            task_graph_node_destroy(graph->nodes[i]);
+        }
+
+        free(graph->nodes);
+        graph->nodes = NULL;
+    }
+
+    pthread_mutex_destroy(&graph->completion_mutex);
+    pthread_cond_destroy(&graph->completion_condition);
+
+    free(graph);
+}
+
+/* Makes room for `count` more successors without linking anything. */
+static task_graph_node_t *_task_graph_node_reserve_successors(task_graph_node_t *node, size_t count)
+{
+    if (node->successor_count + count <= node->successor_capacity) {
+        return node;
+    }
+
+    size_t capacity = 0 == node->successor_capacity ? 4 : node->successor_capacity;
+    while (capacity < node->successor_count + count) {
+        capacity *= 2;
+    }
+
+    task_graph_node_t **successors =
+        (task_graph_node_t **) realloc(
+                                   node->successors,
+                                   sizeof(*successors) * capacity
+                               );
+    if (NULL == successors) {
+        return NULL;
+    }
+
+    node->successors = successors;
+    node->successor_capacity = capacity;
+
+    return node;
+}
+
+static task_graph_node_t *task_graph_add_dependency(
+                              task_graph_t *graph __attribute__((unused)),
+                              task_graph_node_t *predecessor,
+                              task_graph_node_t *successor
+                          )
+{
+    if (NULL == _task_graph_node_reserve_successors(predecessor, 1)) {
+        return NULL;
+    }
+
+    predecessor->successors[predecessor->successor_count++] = successor;
+    successor->predecessor_count += 1;
+
+    return successor;
+}
+
+static task_graph_node_t *task_graph_add_task(
+                              task_graph_t *graph,
+                              void (*task)(void *task_data, void (*result_callback)(void *result)),
+                              void *task_data,
+                              void (*result_callback)(void *result),
+                              task_graph_node_t **predecessors,
+                              size_t predecessor_count
+                          )
+{
+    if (graph->node_count == graph->node_capacity) {
+        size_t capacity =
+            0 == graph->node_capacity ?
+                16 : graph->node_capacity * 2;
+
+        task_graph_node_t **nodes =
+            (task_graph_node_t **) realloc(graph->nodes, sizeof(*nodes) * capacity);
+        if (NULL == nodes) {
+            return NULL;
+        }
+
+        graph->nodes = nodes;
+        graph->node_capacity = capacity;
+    }
+
+    /*
+        Every successor slot is allocated before the node is linked anywhere,
+        so a failure leaves the graph as it was. A predecessor that is listed
+        more than once gets a slot for each time.
+    */
+    for (size_t i = 0; i < predecessor_count; ++i) {
+        if (NULL == predecessors[i]) {
+            continue;
+        }
+
+        if (NULL == _task_graph_node_reserve_successors(predecessors[i], predecessor_count - i)) {
+            return NULL;
+        }
+    }
+
+    task_graph_node_t *node = task_graph_node_create(graph, task, task_data, result_callback);
+    if (NULL == node) {
+        return node;
+    }
+    graph->nodes[graph->node_count++] = node;
+
+    for (size_t i = 0; i < predecessor_count; ++i) {
+        if (NULL == predecessors[i]) {
+            continue;
+        }
+
+        task_graph_add_dependency(graph, predecessors[i], node);
+    }
+
+    return node;
+}
+
+static void _task_graph_node_execute(
+                void *task_data,
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    task_graph_node_t *node = (task_graph_node_t *) task_data;
+    task_graph_t *graph = node->graph;
+    threadpool_t *threadpool = graph->threadpool;
+
+    while (NULL != node) {
+        node->task(node->task_data, node->result_callback);
+
+        task_graph_node_t *next_node = NULL;
+        for (size_t i = 0; i < node->successor_count; ++i) {
+            task_graph_node_t *successor = node->successors[i];
+            if (0 != __sync_sub_and_fetch(&successor->predecessors_left, 1)) {
+                continue;
+            }
+
+            if (NULL == next_node) {
+                next_node = successor;
+            } else {
+                threadpool_enqueue_named_task(threadpool, "task_graph_node", _task_graph_node_execute, successor, NULL);
+            }
+        }
+
+        if (0 == __sync_sub_and_fetch(&graph->nodes_left, 1)) {
+            pthread_mutex_lock(&graph->completion_mutex);
+            graph->is_complete = true;
+            pthread_cond_broadcast(&graph->completion_condition);
+            pthread_mutex_unlock(&graph->completion_mutex);
+        }
+
+        node = next_node;
+    }
+}
+
+/*
+    Runs Kahn's algorithm on `predecessors_left` and returns whether it
+    reaches every node, i.e., whether the graph has no cycles.
+*/
+static bool _task_graph_is_acyclic(task_graph_t *graph)
+{
+    task_graph_node_t **ready_nodes =
+        (task_graph_node_t **) malloc(sizeof(*ready_nodes) * graph->node_count);
+    if (NULL == ready_nodes) {
+        return false;
+    }
+
+    size_t ready_count = 0;
+    for (size_t i = 0; i < graph->node_count; ++i) {
+        task_graph_node_t *node = graph->nodes[i];
+        node->predecessors_left = (ssize_t) node->predecessor_count;
+        if (0 == node->predecessor_count) {
+            ready_nodes[ready_count++] = node;
+        }
+    }
+
+    for (size_t visited_count = 0; visited_count < ready_count; ++visited_count) {
+        task_graph_node_t *node = ready_nodes[visited_count];
+        for (size_t i = 0; i < node->successor_count; ++i) {
+            task_graph_node_t *successor = node->successors[i];
+            if (0 == --successor->predecessors_left) {
+                ready_nodes[ready_count++] = successor;
+            }
+        }
+    }
+
+    free(ready_nodes);
+
+    return ready_count == graph->node_count;
+}
+
+/* Returns NULL without running anything if the graph has a cycle. */
+static task_graph_t *task_graph_run(task_graph_t *graph)
+{
+    if (0 == graph->node_count) {
+        return graph;
+    }
+
+    if (!_task_graph_is_acyclic(graph)) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < graph->node_count; ++i) {
+        task_graph_node_t *node = graph->nodes[i];
+        node->predecessors_left = (ssize_t) node->predecessor_count;
+    }
+
+    graph->nodes_left = (ssize_t) graph->node_count;
+    graph->is_complete = false;
+    __sync_synchronize();
+
+    for (size_t i = 0; i < graph->node_count; ++i) {
+        task_graph_node_t *node = graph->nodes[i];
+        if (0 != node->predecessor_count) {
+            continue;
+        }
+
+        threadpool_enqueue_named_task(graph->threadpool, "task_graph_node", _task_graph_node_execute, node, NULL);
+    }
+
+    return graph;
+}
+
+static void task_graph_wait(task_graph_t *graph)
+{
+    pthread_mutex_lock(&graph->completion_mutex);
+    while (!graph->is_complete) {
+        pthread_cond_wait(&graph->completion_condition, &graph->completion_mutex);
+    }
+    pthread_mutex_unlock(&graph->completion_mutex);
+}
+
+#endif // TASK_GRAPH_H
@@ -3,12 +3,18 @@
 
 #include "work_item.h"
 #include "sync_queue.h"
+#include "trace.h"
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
 
 /* Useful Helpers */
 
@@ -61,27 +67,368 @@ static size_t utils_get_number_of_cpu_cores()
     return (size_t) result;
 }
 
+static inline uint64_t utils_get_monotonic_time_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+}
+
+static inline void utils_cpu_relax(void)
+{
+#if defined __x86_64__ || defined __i386__
+    __builtin_ia32_pause();
+#elif defined __aarch64__
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+/* Queueing Latency Statistics */
+
+/*
+    Latencies are kept in a log-linear histogram: every power of two is split
+    into eight linear buckets, so any percentile is reported with an error of
+    at most 12.5%.
+*/
+
+#define THREADPOOL_LATENCY_SUB_BUCKET_BITS 3
+#define THREADPOOL_LATENCY_SUB_BUCKET_COUNT (1 << THREADPOOL_LATENCY_SUB_BUCKET_BITS)
+#define THREADPOOL_LATENCY_BUCKET_COUNT \
+    ((64 - THREADPOOL_LATENCY_SUB_BUCKET_BITS + 1) * THREADPOOL_LATENCY_SUB_BUCKET_COUNT)
+
+typedef struct _threadpool_latency_stats
+{
+    volatile uint64_t count;
+    volatile uint64_t total_ns;
+    volatile uint64_t max_ns;
+    volatile uint64_t buckets[THREADPOOL_LATENCY_BUCKET_COUNT];
+} threadpool_latency_stats_t;
+
+static inline size_t _threadpool_latency_get_bucket(uint64_t latency_ns)
+{
+    if (latency_ns < THREADPOOL_LATENCY_SUB_BUCKET_COUNT) {
+        return (size_t) latency_ns;
+    }
+
+    size_t magnitude = 63 - (size_t) __builtin_clzll(latency_ns);
+    size_t shift = magnitude - THREADPOOL_LATENCY_SUB_BUCKET_BITS;
+
+    return (magnitude - THREADPOOL_LATENCY_SUB_BUCKET_BITS + 1) * THREADPOOL_LATENCY_SUB_BUCKET_COUNT +
+               (size_t) ((latency_ns >> shift) & (THREADPOOL_LATENCY_SUB_BUCKET_COUNT - 1));
+}
+
+static inline uint64_t _threadpool_latency_get_bucket_lower_bound(size_t bucket)
+{
+    if (bucket < THREADPOOL_LATENCY_SUB_BUCKET_COUNT) {
+        return (uint64_t) bucket;
+    }
+
+    size_t magnitude = bucket / THREADPOOL_LATENCY_SUB_BUCKET_COUNT + THREADPOOL_LATENCY_SUB_BUCKET_BITS - 1;
+    size_t sub_bucket = bucket % THREADPOOL_LATENCY_SUB_BUCKET_COUNT;
+
+    return (uint64_t) (THREADPOOL_LATENCY_SUB_BUCKET_COUNT + sub_bucket) <<
+               (magnitude - THREADPOOL_LATENCY_SUB_BUCKET_BITS);
+}
+
+static inline void threadpool_latency_stats_record(threadpool_latency_stats_t *stats, uint64_t latency_ns)
+{
+    __sync_fetch_and_add(&stats->count, 1);
+    __sync_fetch_and_add(&stats->total_ns, latency_ns);
+    __sync_fetch_and_add(&stats->buckets[_threadpool_latency_get_bucket(latency_ns)], 1);
+
+    uint64_t max_ns = stats->max_ns;
+    while (latency_ns > max_ns) {
+        uint64_t previous = __sync_val_compare_and_swap(&stats->max_ns, max_ns, latency_ns);
+        if (previous == max_ns) {
+            break;
+        }
+        max_ns = previous;
+    }
+}
+
+static inline void threadpool_latency_stats_merge(
+                       threadpool_latency_stats_t *stats,
+                       const threadpool_latency_stats_t *other
+                   )
+{
+    stats->count += other->count;
+    stats->total_ns += other->total_ns;
+    stats->max_ns = stats->max_ns > other->max_ns ? stats->max_ns : other->max_ns;
+
+    for (size_t i = 0; i < THREADPOOL_LATENCY_BUCKET_COUNT; ++i) {
+        stats->buckets[i] += other->buckets[i];
+    }
+}
+
+/* Returns the lower bound of the bucket holding the given percentile (0.0-1.0). */
+static uint64_t threadpool_latency_stats_get_percentile(
+                    const threadpool_latency_stats_t *stats,
+                    double percentile
+                )
+{
+    if (0 == stats->count) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (percentile * (double) stats->count);
+    if (rank >= stats->count) {
+        rank = stats->count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < THREADPOOL_LATENCY_BUCKET_COUNT; ++i) {
+        seen += stats->buckets[i];
+        if (seen > rank) {
+            return _threadpool_latency_get_bucket_lower_bound(i);
+        }
+    }
+
+    return stats->max_ns;
+}
+
 /* Threadpool */
 
-typedef struct _threadpool
+/*
+    Tasks are queued into priority lanes. The high-priority lane is meant for
+    small latency-sensitive requests. It is FIFO and by default gets four
+    tasks for every task of the normal lane when both have work, so it can
+    neither be starved by nor starve a batch of large jobs.
+*/
+
+typedef enum _threadpool_priority
+{
+    THREADPOOL_PRIORITY_NORMAL,
+    THREADPOOL_PRIORITY_HIGH,
+    THREADPOOL_PRIORITY_COUNT
+} threadpool_priority_t;
+
+static const char *Threadpool_Priority_Names[THREADPOOL_PRIORITY_COUNT] = {
+    "normal",
+    "high"
+};
+
+/*
+    An idle worker first spins on the queue size with a pause instruction,
+    then yields its core a few times, and only then parks on the queue's
+    condition variable. Parking costs a futex wake and a context switch per
+    task, which dominates bursts of small tasks.
+
+    With the adaptive strategy, every worker tracks a moving average of how
+    long it had to wait for its recent tasks and spins for about twice that
+    long (up to `spin_ns`). When tasks arrive rarely, the average exceeds the
+    budget and the worker parks almost right away instead of burning a core.
+*/
+
+typedef enum _threadpool_idle_strategy
+{
+    THREADPOOL_IDLE_PARK,
+    THREADPOOL_IDLE_SPIN_THEN_PARK,
+    THREADPOOL_IDLE_ADAPTIVE
+} threadpool_idle_strategy_t;
+
+typedef struct _threadpool_idle_policy
+{
+    threadpool_idle_strategy_t strategy;
+    uint64_t spin_ns;
+    size_t yield_count;
+} threadpool_idle_policy_t;
+
+static const threadpool_idle_policy_t Threadpool_Default_Idle_Policy = {
+    THREADPOOL_IDLE_ADAPTIVE,
+    50000,
+    4
+};
+
+#define THREADPOOL_IDLE_MINIMUM_SPIN_NS 1000
+
+/* Calibrated once: the cost of a pause differs by an order of magnitude between CPUs. */
+static volatile uint64_t _threadpool_pause_cost_ps = 0;
+
+static uint64_t _threadpool_calibrate_pause(void)
+{
+    static const size_t Iterations = 10000;
+
+    uint64_t cost_ps = _threadpool_pause_cost_ps;
+    if (0 != cost_ps) {
+        return cost_ps;
+    }
+
+    uint64_t start = utils_get_monotonic_time_ns();
+    for (size_t i = 0; i < Iterations; ++i) {
+        utils_cpu_relax();
+    }
+    uint64_t elapsed = utils_get_monotonic_time_ns() - start;
+
+    cost_ps = elapsed * 1000 / Iterations;
+    if (0 == cost_ps) {
+        cost_ps = 1;
+    }
+    _threadpool_pause_cost_ps = cost_ps;
+
+    return cost_ps;
+}
+
+typedef struct _threadpool threadpool_t;
+
+typedef struct _threadpool_worker
+{
+    threadpool_t *threadpool;
+    size_t index;
+
+    threadpool_latency_stats_t latency[THREADPOOL_PRIORITY_COUNT];
+    uint64_t average_wait_ns;
+} threadpool_worker_t;
+
+struct _threadpool
 {
     sync_queue_t *queue;
 
     pthread_t *threads;
+    threadpool_worker_t *workers;
     size_t thread_count;
-} threadpool_t;
+
+    threadpool_idle_policy_t idle_policy;
+};
+
+static __thread threadpool_worker_t *_threadpool_current_worker = NULL;
+static __thread size_t _threadpool_current_priority = THREADPOOL_PRIORITY_NORMAL;
+
+/* Threads outside of the pool (e.g., the main one) get `thread_count` as their index. */
+static inline size_t threadpool_get_current_worker_index(threadpool_t *threadpool)
+{
+    threadpool_worker_t *worker = _threadpool_current_worker;
+    if (NULL == worker || worker->threadpool != threadpool) {
+        return threadpool->thread_count;
+    }
+
+    return worker->index;
+}
+
+static inline void _threadpool_execute_work_item(threadpool_t *threadpool, work_item_t *work_item)
+{
+    volatile ssize_t *pending_tasks = work_item->pending_tasks;
+
+    /* Threads outside of the pool share the extra worker slot at `thread_count`. */
+    size_t worker_index = threadpool_get_current_worker_index(threadpool);
+    threadpool_latency_stats_record(
+        &threadpool->workers[worker_index].latency[work_item->priority],
+        utils_get_monotonic_time_ns() - work_item->enqueue_time
+    );
+
+    size_t previous_priority = _threadpool_current_priority;
+    _threadpool_current_priority = work_item->priority;
+
+    const char *name = work_item->name;
+    uint64_t begin = trace_get_ticks();
+    work_item->task(work_item->task_data, work_item->result_callback);
+    trace_record(name, begin, trace_get_ticks());
+
+    work_item_destroy(work_item);
+
+    _threadpool_current_priority = previous_priority;
+
+    if (NULL != pending_tasks) {
+        __sync_sub_and_fetch(pending_tasks, 1);
+    }
+}
+
+static inline uint64_t _threadpool_worker_get_spin_budget(
+                           threadpool_worker_t *worker,
+                           const threadpool_idle_policy_t *policy
+                       )
+{
+    if (THREADPOOL_IDLE_ADAPTIVE != policy->strategy) {
+        return policy->spin_ns;
+    }
+
+    uint64_t budget = worker->average_wait_ns * 2;
+    if (budget > policy->spin_ns) {
+        return 0;
+    }
+
+    return budget < THREADPOOL_IDLE_MINIMUM_SPIN_NS ? THREADPOOL_IDLE_MINIMUM_SPIN_NS : budget;
+}
+
+static inline void _threadpool_worker_record_wait(threadpool_worker_t *worker, uint64_t wait_ns)
+{
+    /* Exponential moving average with a weight of 1/8 for the new sample. */
+    int64_t difference = (int64_t) wait_ns - (int64_t) worker->average_wait_ns;
+    worker->average_wait_ns = (uint64_t) ((int64_t) worker->average_wait_ns + difference / 8);
+}
+
+static work_item_t *_threadpool_worker_wait_for_work(threadpool_worker_t *worker)
+{
+    threadpool_t *threadpool = worker->threadpool;
+    sync_queue_t *queue = threadpool->queue;
+
+    work_item_t *work_item = (work_item_t *) sync_queue_try_take(queue);
+    if (NULL != work_item) {
+        return work_item;
+    }
+
+    threadpool_idle_policy_t policy = threadpool->idle_policy;
+    if (THREADPOOL_IDLE_PARK == policy.strategy) {
+        return (work_item_t *) sync_queue_take(queue);
+    }
+
+    uint64_t idle_start = utils_get_monotonic_time_ns();
+
+    uint64_t spin_budget = _threadpool_worker_get_spin_budget(worker, &policy);
+    uint64_t spin_iterations = spin_budget * 1000 / _threadpool_pause_cost_ps;
+    for (uint64_t i = 0; i < spin_iterations && !sync_queue_is_closed(queue); ++i) {
+        if (!sync_queue_is_empty(queue)) {
+            work_item = (work_item_t *) sync_queue_try_take(queue);
+            if (NULL != work_item) {
+                goto end;
+            }
+        }
+
+        utils_cpu_relax();
+    }
+
+    for (size_t i = 0; i < policy.yield_count && !sync_queue_is_closed(queue); ++i) {
+        sched_yield();
+
+        if (!sync_queue_is_empty(queue)) {
+            work_item = (work_item_t *) sync_queue_try_take(queue);
+            if (NULL != work_item) {
+                goto end;
+            }
+        }
+    }
+
+    work_item = (work_item_t *) sync_queue_take(queue);
+
+end:
+    _threadpool_worker_record_wait(worker, utils_get_monotonic_time_ns() - idle_start);
+
+    return work_item;
+}
 
 static void *_thread_start(void *args)
 {
-    sync_queue_t *queue = (sync_queue_t *) args;
+    threadpool_worker_t *worker = (threadpool_worker_t *) args;
+    _threadpool_current_worker = worker;
+
+#ifdef THREADPOOL_TRACING
+    char thread_name[TRACE_THREAD_NAME_LENGTH];
+    snprintf(thread_name, sizeof(thread_name), "worker %zu", worker->index);
+    trace_set_thread_name(thread_name);
+#endif
+
+    threadpool_t *threadpool = worker->threadpool;
     while (true) {
-        work_item_t *work_item = (work_item_t *) sync_queue_pop(queue);
+        work_item_t *work_item = _threadpool_worker_wait_for_work(worker);
         if (NULL == work_item) {
+            if (sync_queue_is_closed(threadpool->queue)) {
+                break;
+            }
+
             continue;
         }
 
-        work_item->task(work_item->task_data, work_item->result_callback);
-        work_item_destroy(work_item);
+        _threadpool_execute_work_item(threadpool, work_item);
     }
 
     return NULL;
@@ -96,26 +443,43 @@ static threadpool_t *threadpool_init(threadpool_t *threadpool, size_t pool_size)
 {
     threadpool->thread_count =
         pool_size;
+    threadpool->idle_policy =
+        Threadpool_Default_Idle_Policy;
+    _threadpool_calibrate_pause();
 
     threadpool->queue = sync_queue_create();
     if (NULL == threadpool->queue) {
         return NULL;
     }
+    sync_queue_set_lane(threadpool->queue, THREADPOOL_PRIORITY_NORMAL, 1, SYNC_QUEUE_POLICY_LIFO);
+    sync_queue_set_lane(threadpool->queue, THREADPOOL_PRIORITY_HIGH,   4, SYNC_QUEUE_POLICY_FIFO);
 
     threadpool->threads = (pthread_t *) malloc(sizeof(pthread_t) * pool_size);
-    if (NULL == threadpool->threads) {
+    threadpool->workers = (threadpool_worker_t *) calloc(pool_size + 1, sizeof(threadpool_worker_t));
+    if (NULL == threadpool->threads || NULL == threadpool->workers) {
+        free(threadpool->threads);
+        threadpool->threads = NULL;
+        free(threadpool->workers);
+        threadpool->workers = NULL;
+
         sync_queue_destroy(threadpool->queue);
         threadpool->queue = NULL;
 
         return NULL;
     }
 
+    for (size_t i = 0; i <= pool_size; ++i) {
+        threadpool->workers[i].threadpool = threadpool;
+        threadpool->workers[i].index = i;
+    }
+
+    trace_begin_session();
     for (size_t i = 0; i < pool_size; ++i) {
         pthread_create(
             &threadpool->threads[i],
             NULL,
             _thread_start,
-            (void *) threadpool->queue
+            (void *) &threadpool->workers[i]
         );
     }
 
@@ -138,21 +502,29 @@ static inline threadpool_t *threadpool_create(size_t pool_size)
     return threadpool;
 }
 
-static void threadpool_destroy(threadpool_t *threadpool)
+/* Workers finish all tasks that are already queued before they exit. */
+static inline void threadpool_destroy(threadpool_t *threadpool)
 {
     if (NULL == threadpool) {
         return;
     }
 
     if (NULL != threadpool->threads) {
+        sync_queue_close(threadpool->queue);
         for (size_t i = 0; i < threadpool->thread_count; ++i) {
             pthread_join(threadpool->threads[i], NULL);
         }
+        trace_end_session();
 
         free(threadpool->threads);
         threadpool->threads = NULL;
     }
 
+    if (NULL != threadpool->workers) {
+        free(threadpool->workers);
+        threadpool->workers = NULL;
+    }
+
     if (NULL != threadpool->queue) {
         sync_queue_destroy(threadpool->queue);
         threadpool->queue = NULL;
@@ -161,8 +533,51 @@ static void threadpool_destroy(threadpool_t *threadpool)
     free(threadpool);
 }
 
-static inline void threadpool_enqueue_task(
+/* Takes effect the next time a worker runs out of tasks. */
+static inline void threadpool_set_idle_policy(
+                       threadpool_t *threadpool,
+                       const threadpool_idle_policy_t *idle_policy
+                   )
+{
+    threadpool->idle_policy = *idle_policy;
+}
+
+/* Must be called before any tasks are enqueued. */
+static inline threadpool_t *threadpool_set_priority_lane(
+                                threadpool_t *threadpool,
+                                threadpool_priority_t priority,
+                                size_t weight,
+                                sync_queue_policy_t policy
+                            )
+{
+    if (NULL == sync_queue_set_lane(threadpool->queue, (size_t) priority, weight, policy)) {
+        return NULL;
+    }
+
+    return threadpool;
+}
+
+static inline sync_queue_t *_threadpool_enqueue_work_item(
+                               threadpool_t *threadpool,
+                               work_item_t *work_item,
+                               size_t priority
+                           )
+{
+    if (priority >= THREADPOOL_PRIORITY_COUNT) {
+        priority = THREADPOOL_PRIORITY_COUNT - 1;
+    }
+
+    work_item->priority = priority;
+    work_item->enqueue_time = utils_get_monotonic_time_ns();
+
+    return sync_queue_enqueue_to_lane(threadpool->queue, work_item, priority);
+}
+
+/* The name shows up in the trace timeline (see trace.h) and must outlive the trace. */
+static inline void threadpool_enqueue_named_task_with_priority(
                        threadpool_t *threadpool,
+                       threadpool_priority_t priority,
+                       const char *name,
                        void (*task)(void *task_data, void (*result_callback)(void *result)),
                        void *task_data,
                        void (*result_callback)(void *result)
@@ -172,8 +587,155 @@ static inline void threadpool_enqueue_task(
     if (NULL == work_item) {
         return;
     }
+    work_item->name = name;
+
+    if (NULL == _threadpool_enqueue_work_item(threadpool, work_item, (size_t) priority)) {
+        work_item_destroy(work_item);
+    }
+}
+
+static inline void threadpool_enqueue_task_with_priority(
+                       threadpool_t *threadpool,
+                       threadpool_priority_t priority,
+                       void (*task)(void *task_data, void (*result_callback)(void *result)),
+                       void *task_data,
+                       void (*result_callback)(void *result)
+                   )
+{
+    threadpool_enqueue_named_task_with_priority(
+        threadpool, priority, NULL,
+        task, task_data, result_callback
+    );
+}
+
+static inline void threadpool_enqueue_named_task(
+                       threadpool_t *threadpool,
+                       const char *name,
+                       void (*task)(void *task_data, void (*result_callback)(void *result)),
+                       void *task_data,
+                       void (*result_callback)(void *result)
+                   )
+{
+    threadpool_enqueue_named_task_with_priority(
+        threadpool, THREADPOOL_PRIORITY_NORMAL, name,
+        task, task_data, result_callback
+    );
+}
+
+static inline void threadpool_enqueue_task(
+                       threadpool_t *threadpool,
+                       void (*task)(void *task_data, void (*result_callback)(void *result)),
+                       void *task_data,
+                       void (*result_callback)(void *result)
+                   )
+{
+    threadpool_enqueue_named_task_with_priority(
+        threadpool, THREADPOOL_PRIORITY_NORMAL, NULL,
+        task, task_data, result_callback
+    );
+}
+
+static inline void threadpool_get_latency_stats(
+                threadpool_t *threadpool,
+                threadpool_priority_t priority,
+                threadpool_latency_stats_t *stats
+            )
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i <= threadpool->thread_count; ++i) {
+        threadpool_latency_stats_merge(stats, &threadpool->workers[i].latency[priority]);
+    }
+}
+
+static inline void threadpool_print_latency_report(threadpool_t *threadpool, FILE *stream)
+{
+    threadpool_latency_stats_t *stats =
+        (threadpool_latency_stats_t *) malloc(sizeof(*stats));
+    if (NULL == stats) {
+        return;
+    }
+
+    fprintf(stream, "priority,tasks,mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+    for (size_t i = 0; i < THREADPOOL_PRIORITY_COUNT; ++i) {
+        threadpool_get_latency_stats(threadpool, (threadpool_priority_t) i, stats);
+
+        fprintf(
+            stream,
+            "%s,%llu,%llu,%llu,%llu,%llu,%llu\n",
+            Threadpool_Priority_Names[i],
+            (unsigned long long) stats->count,
+            (unsigned long long) (0 == stats->count ? 0 : stats->total_ns / stats->count),
+            (unsigned long long) threadpool_latency_stats_get_percentile(stats, 0.50),
+            (unsigned long long) threadpool_latency_stats_get_percentile(stats, 0.90),
+            (unsigned long long) threadpool_latency_stats_get_percentile(stats, 0.99),
+            (unsigned long long) stats->max_ns
+        );
+    }
+
+    free(stats);
+}
+
+/* Fork-Join */
+
+/*
+    Tasks running on the pool may spawn subtasks into a group and then wait
+    for the group. A waiting thread does not block: it keeps executing pending
+    tasks from the pool's queue (most likely its own children, as the queue is
+    LIFO) until every task of the group has finished. Nested spawns therefore
+    cannot deadlock the pool even if all workers are waiting.
+*/
+
+typedef struct _task_group
+{
+    volatile ssize_t pending_tasks;
+} task_group_t;
+
+static inline task_group_t *task_group_init(task_group_t *group)
+{
+    group->pending_tasks = 0;
+
+    return group;
+}
+
+static inline task_group_t *threadpool_spawn(
+                               threadpool_t *threadpool,
+                               task_group_t *group,
+                               void (*task)(void *task_data, void (*result_callback)(void *result)),
+                               void *task_data,
+                               void (*result_callback)(void *result)
+                           )
+{
+    work_item_t *work_item = work_item_create(task, task_data, result_callback);
+    if (NULL == work_item) {
+        return NULL;
+    }
+    work_item->pending_tasks = &group->pending_tasks;
+
+    /* Subtasks inherit the priority of the task that spawns them. */
+    __sync_add_and_fetch(&group->pending_tasks, 1);
+    if (NULL == _threadpool_enqueue_work_item(threadpool, work_item, _threadpool_current_priority)) {
+        __sync_sub_and_fetch(&group->pending_tasks, 1);
+        work_item_destroy(work_item);
+
+        return NULL;
+    }
+
+    return group;
+}
+
+static inline void threadpool_sync(threadpool_t *threadpool, task_group_t *group)
+{
+    while (0 < group->pending_tasks) {
+        work_item_t *work_item = (work_item_t *) sync_queue_try_take(threadpool->queue);
+        if (NULL != work_item) {
+            _threadpool_execute_work_item(threadpool, work_item);
+        } else {
+            sched_yield();
+        }
+    }
 
-    sync_queue_enqueue(threadpool->queue, work_item);
+    __sync_synchronize();
 }
 
 #endif // THREADPOOL_H
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+/*
+    Microbenchmarks for threadpool.h, sync_queue.h and queue.h.
+
+    Usage: threadpool_bench [--json] [--seed <n>] [--max-threads <n>] [--tasks <n>]
+
+    * throughput:  empty tasks per second pushed by the main thread
+    * latency:     enqueue-to-execution latency distribution for every idle policy
+    * fan-out:     cost of spawning N empty chunks and waiting for them
+    * scalability: time and speedup of a compute-bound reduction from 1 to all cores
+    * allocator:   allocations and bytes per task, and throughput with one producer per worker
+
+    Worker i is pinned to core (i + 1) mod cores and the main thread to core 0
+    (on Linux). Inputs are generated from a fixed seed. Results are written to
+    stdout as CSV (default) or JSON.
+*/
+
+/* Allocation Counting */
+
+static volatile uint64_t bench_allocations = 0;
+static volatile uint64_t bench_allocated_bytes = 0;
+
+static void *bench_counting_malloc(size_t size)
+{
+    __sync_fetch_and_add(&bench_allocations, 1);
+    __sync_fetch_and_add(&bench_allocated_bytes, size);
+
+    return malloc(size);
+}
+
+static void *bench_counting_calloc(size_t count, size_t size)
+{
+    __sync_fetch_and_add(&bench_allocations, 1);
+    __sync_fetch_and_add(&bench_allocated_bytes, count * size);
+
+    return calloc(count, size);
+}
+
+/* Every allocation made by the pool headers goes through the counters above. */
+#define malloc(SIZE) bench_counting_malloc(SIZE)
+#define calloc(COUNT, SIZE) bench_counting_calloc(COUNT, SIZE)
+
+#include "threadpool.h"
+#include "parallel_reduce.h"
+
+#undef malloc
+#undef calloc
+
+/* Constants */
+
+static const uint64_t Default_Seed = 42;
+static const size_t Default_Task_Count = 1000000;
+static const size_t Latency_Task_Count = 20000;
+static const uint64_t Latency_Arrival_Gap_ns = 20000;
+static const size_t Fan_Out_Rounds = 200;
+static const size_t Fan_Out_Chunk_Counts[] = { 1, 8, 64, 512, 4096 };
+static const size_t Scalability_Element_Count = 1 << 22;
+static const size_t Scalability_Inner_Iterations = 32;
+
+/* Reporting */
+
+static bool bench_is_json = false;
+static bool bench_has_records = false;
+
+static void report(const char *benchmark, size_t threads, const char *parameter, const char *metric, double value)
+{
+    if (bench_is_json) {
+        printf(
+            "%s\n  {\"benchmark\": \"%s\", \"threads\": %zu, \"parameter\": \"%s\", \"metric\": \"%s\", \"value\": %.3f}",
+            bench_has_records ? "," : "",
+            benchmark, threads, parameter, metric, value
+        );
+    } else {
+        printf("%s,%zu,%s,%s,%.3f\n", benchmark, threads, parameter, metric, value);
+    }
+    fflush(stdout);
+
+    bench_has_records = true;
+}
+
+/* Setup */
+
+static void pin_thread(pthread_t thread, size_t core)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % utils_get_number_of_cpu_cores(), &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    (void) thread;
+    (void) core;
+#endif
+}
+
+static threadpool_t *create_pinned_threadpool(size_t thread_count, const threadpool_idle_policy_t *idle_policy)
+{
+    threadpool_t *threadpool = threadpool_create(thread_count);
+    if (NULL == threadpool) {
+        return threadpool;
+    }
+
+    if (NULL != idle_policy) {
+        threadpool_set_idle_policy(threadpool, idle_policy);
+    }
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        pin_thread(threadpool->threads[i], i + 1);
+    }
+
+    return threadpool;
+}
+
+static uint64_t bench_random_state;
+
+static uint32_t bench_random(void)
+{
+    /* xorshift64*, so results do not depend on the libc's rand. */
+    bench_random_state ^= bench_random_state >> 12;
+    bench_random_state ^= bench_random_state << 25;
+    bench_random_state ^= bench_random_state >> 27;
+
+    return (uint32_t) ((bench_random_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void busy_wait_until(uint64_t deadline_ns)
+{
+    while (utils_get_monotonic_time_ns() < deadline_ns) {
+        utils_cpu_relax();
+    }
+}
+
+/* Tasks */
+
+static volatile size_t completed_tasks = 0;
+
+static void empty_task(
+                void *task_data __attribute__((unused)),
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+}
+
+static void counting_task(
+                void *task_data __attribute__((unused)),
+                void (*result_callback)(void *result) __attribute__((unused))
+            )
+{
+    __sync_fetch_and_add(&completed_tasks, 1);
+}
+
+static void wait_for_completed_tasks(size_t task_count)
+{
+    while (completed_tasks < task_count) {
+        sched_yield();
+    }
+}
+
+/* Benchmarks */
+
+static void bench_throughput(size_t thread_count, size_t task_count)
+{
+    threadpool_t *threadpool = create_pinned_threadpool(thread_count, NULL);
+    if (NULL == threadpool) {
+        return;
+    }
+
+    completed_tasks = 0;
+    uint64_t allocations = bench_allocations;
+    uint64_t allocated_bytes = bench_allocated_bytes;
+
+    uint64_t start = utils_get_monotonic_time_ns();
+    for (size_t i = 0; i < task_count; ++i) {
+        threadpool_enqueue_task(threadpool, counting_task, NULL, NULL);
+    }
+    uint64_t enqueued = utils_get_monotonic_time_ns();
+    wait_for_completed_tasks(task_count);
+    uint64_t end = utils_get_monotonic_time_ns();
+
+    report("throughput", thread_count, "empty", "tasks_per_second", (double) task_count * 1e9 / (double) (end - start));
+    report("throughput", thread_count, "empty", "enqueue_ns", (double) (enqueued - start) / (double) task_count);
+
+    report(
+        "allocator", thread_count, "enqueue", "allocations_per_task",
+        (double) (bench_allocations - allocations) / (double) task_count
+    );
+    report(
+        "allocator", thread_count, "enqueue", "bytes_per_task",
+        (double) (bench_allocated_bytes - allocated_bytes) / (double) task_count
+    );
+
+    threadpool_destroy(threadpool);
+}
+
+static void bench_latency(size_t thread_count, const char *policy_name, const threadpool_idle_policy_t *idle_policy)
+{
+    threadpool_t *threadpool = create_pinned_threadpool(thread_count, idle_policy);
+    if (NULL == threadpool) {
+        return;
+    }
+
+    completed_tasks = 0;
+
+    /* Arrivals are jittered around the mean gap so they do not phase-lock with the spinning workers. */
+    uint64_t next_arrival = utils_get_monotonic_time_ns();
+    for (size_t i = 0; i < Latency_Task_Count; ++i) {
+        next_arrival += Latency_Arrival_Gap_ns / 2 + bench_random() % Latency_Arrival_Gap_ns;
+        busy_wait_until(next_arrival);
+
+        threadpool_enqueue_task(threadpool, counting_task, NULL, NULL);
+    }
+    wait_for_completed_tasks(Latency_Task_Count);
+
+    threadpool_latency_stats_t *stats = (threadpool_latency_stats_t *) malloc(sizeof(*stats));
+    if (NULL != stats) {
+        threadpool_get_latency_stats(threadpool, THREADPOOL_PRIORITY_NORMAL, stats);
+
+        report("latency", thread_count, policy_name, "mean_ns", (double) stats->total_ns / (double) stats->count);
+        report("latency", thread_count, policy_name, "p50_ns", (double) threadpool_latency_stats_get_percentile(stats, 0.50));
+        report("latency", thread_count, policy_name, "p90_ns", (double) threadpool_latency_stats_get_percentile(stats, 0.90));
+        report("latency", thread_count, policy_name, "p99_ns", (double) threadpool_latency_stats_get_percentile(stats, 0.99));
+        report("latency", thread_count, policy_name, "max_ns", (double) stats->max_ns);
+
+        free(stats);
+    }
+
+    threadpool_destroy(threadpool);
+}
+
+static void bench_fan_out(size_t thread_count)
+{
+    threadpool_t *threadpool = create_pinned_threadpool(thread_count, NULL);
+    if (NULL == threadpool) {
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(Fan_Out_Chunk_Counts) / sizeof(Fan_Out_Chunk_Counts[0]); ++i) {
+        size_t chunk_count = Fan_Out_Chunk_Counts[i];
+
+        uint64_t start = utils_get_monotonic_time_ns();
+        for (size_t round = 0; round < Fan_Out_Rounds; ++round) {
+            task_group_t group;
+            task_group_init(&group);
+
+            for (size_t j = 0; j < chunk_count; ++j) {
+                threadpool_spawn(threadpool, &group, empty_task, NULL, NULL);
+            }
+            threadpool_sync(threadpool, &group);
+        }
+        uint64_t end = utils_get_monotonic_time_ns();
+
+        char parameter[32];
+        snprintf(parameter, sizeof(parameter), "%zu_chunks", chunk_count);
+        report("fan_out", thread_count, parameter, "ns_per_round", (double) (end - start) / (double) Fan_Out_Rounds);
+    }
+
+    threadpool_destroy(threadpool);
+}
+
+static void scalability_identity(void *accumulator, void *context __attribute__((unused)))
+{
+    *(double *) accumulator = 0.0;
+}
+
+static void scalability_combine(void *accumulator, size_t begin, size_t end, void *context)
+{
+    const float *values = (const float *) context;
+
+    double sum = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+        float x = values[i];
+        for (size_t j = 0; j < Scalability_Inner_Iterations; ++j) {
+            x = x * 0.999f + 0.001f;
+        }
+        sum += x;
+    }
+
+    *(double *) accumulator += sum;
+}
+
+static void scalability_merge(void *accumulator, const void *other, void *context __attribute__((unused)))
+{
+    *(double *) accumulator += *(const double *) other;
+}
+
+static void bench_scalability(size_t thread_count, const float *values, double *single_thread_ns)
+{
+    threadpool_t *threadpool = create_pinned_threadpool(thread_count, NULL);
+    if (NULL == threadpool) {
+        return;
+    }
+
+    double sum;
+    uint64_t start = utils_get_monotonic_time_ns();
+    threadpool_parallel_reduce(
+        threadpool, 0, Scalability_Element_Count, 0,
+        &sum, sizeof(sum),
+        scalability_identity, scalability_combine, scalability_merge,
+        (void *) values
+    );
+    uint64_t elapsed = utils_get_monotonic_time_ns() - start;
+
+    if (1 == thread_count) {
+        *single_thread_ns = (double) elapsed;
+    }
+
+    report("scalability", thread_count, "reduce", "time_ns", (double) elapsed);
+    report("scalability", thread_count, "reduce", "speedup", *single_thread_ns / (double) elapsed);
+
+    threadpool_destroy(threadpool);
+}
+
+typedef struct _producer_data
+{
+    threadpool_t *threadpool;
+    size_t task_count;
+} producer_data_t;
+
+static void *producer_start(void *args)
+{
+    producer_data_t *data = (producer_data_t *) args;
+
+    for (size_t i = 0; i < data->task_count; ++i) {
+        threadpool_enqueue_task(data->threadpool, counting_task, NULL, NULL);
+    }
+
+    return NULL;
+}
+
+/* Items are allocated by the producers and freed by the workers, which stresses the allocator's cross-thread frees. */
+static void bench_allocator(size_t thread_count, size_t task_count)
+{
+    threadpool_t *threadpool = create_pinned_threadpool(thread_count, NULL);
+    pthread_t *producers = (pthread_t *) malloc(sizeof(*producers) * thread_count);
+    if (NULL == threadpool || NULL == producers) {
+        threadpool_destroy(threadpool);
+        free(producers);
+
+        return;
+    }
+
+    completed_tasks = 0;
+    producer_data_t data = { threadpool, task_count / thread_count };
+
+    uint64_t start = utils_get_monotonic_time_ns();
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_create(&producers[i], NULL, producer_start, &data);
+        pin_thread(producers[i], i + 1);
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+    wait_for_completed_tasks(data.task_count * thread_count);
+    uint64_t end = utils_get_monotonic_time_ns();
+
+    report(
+        "allocator", thread_count, "producer_per_worker", "tasks_per_second",
+        (double) (data.task_count * thread_count) * 1e9 / (double) (end - start)
+    );
+
+    free(producers);
+    threadpool_destroy(threadpool);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int Base = 10;
+
+    uint64_t seed = Default_Seed;
+    size_t task_count = Default_Task_Count;
+    size_t max_threads = utils_get_number_of_cpu_cores();
+
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--json")) {
+            bench_is_json = true;
+        } else if (0 == strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = (uint64_t) strtoull(argv[++i], NULL, Base);
+        } else if (0 == strcmp(argv[i], "--max-threads") && i + 1 < argc) {
+            max_threads = (size_t) strtoul(argv[++i], NULL, Base);
+        } else if (0 == strcmp(argv[i], "--tasks") && i + 1 < argc) {
+            task_count = (size_t) strtoul(argv[++i], NULL, Base);
+        } else {
+            fprintf(
+                stderr,
+                "Usage: %s [--json] [--seed <n>] [--max-threads <n>] [--tasks <n>]\n",
+                argv[0]
+            );
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (0 == max_threads) {
+        max_threads = 1;
+    }
+    if (0 == task_count) {
+        task_count = 1;
+    }
+
+    bench_random_state = 0 == seed ? 1 : seed;
+    pin_thread(pthread_self(), 0);
+
+    float *values = (float *) malloc(sizeof(*values) * Scalability_Element_Count);
+    if (NULL == values) {
+        fputs("Out of memory.\n", stderr);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < Scalability_Element_Count; ++i) {
+        values[i] = (float) bench_random() / (float) UINT32_MAX;
+    }
+
+    static const threadpool_idle_policy_t Park_Policy = { THREADPOOL_IDLE_PARK, 0, 0 };
+    static const threadpool_idle_policy_t Spin_Policy = { THREADPOOL_IDLE_SPIN_THEN_PARK, 50000, 4 };
+
+    if (bench_is_json) {
+        printf("[");
+    } else {
+        printf("benchmark,threads,parameter,metric,value\n");
+    }
+
+    double single_thread_ns = 0.0;
+    for (size_t thread_count = 1; ; thread_count *= 2) {
+        if (thread_count > max_threads) {
+            thread_count = max_threads;
+        }
+
+        bench_throughput(thread_count, task_count);
+        bench_latency(thread_count, "park", &Park_Policy);
+        bench_latency(thread_count, "spin_then_park", &Spin_Policy);
+        bench_latency(thread_count, "adaptive", &Threadpool_Default_Idle_Policy);
+        bench_fan_out(thread_count);
+        bench_scalability(thread_count, values, &single_thread_ns);
+        bench_allocator(thread_count, task_count);
+
+        if (thread_count == max_threads) {
+            break;
+        }
+    }
+
+    if (bench_is_json) {
+        printf("\n]\n");
+    }
+
+    free(values);
+
+    return EXIT_SUCCESS;
+}
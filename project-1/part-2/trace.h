@@ -0,0 +1,320 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+    Optional timeline tracer for pool tasks, enabled by compiling with
+    -DTHREADPOOL_TRACING. Every thread records the begin and end timestamps
+    of its tasks into its own ring buffer, so recording needs no locks and no
+    shared cache lines. When the buffer wraps, the oldest events are lost.
+
+    Pools open a trace session when they start and close it after their
+    workers are joined. When the last session closes, the buffers are
+    appended to a Chrome trace-event JSON file (named by the
+    THREADPOOL_TRACE_FILE environment variable, or "threadpool_trace.json")
+    and freed. The file can be opened in chrome://tracing or
+    ui.perfetto.dev at any point after that, so a program that runs several
+    pools one after another gets all of them in one timeline.
+
+    Timestamps are taken with rdtsc on x86 and converted to nanoseconds with a
+    ratio measured against the monotonic clock between the first event and
+    the moment the trace is written.
+*/
+
+#ifndef TRACE_BUFFER_CAPACITY
+#define TRACE_BUFFER_CAPACITY (1 << 16)
+#endif
+
+#define TRACE_THREAD_NAME_LENGTH 32
+
+#ifdef THREADPOOL_TRACING
+
+static const char *Trace_Default_File_Name = "threadpool_trace.json";
+
+typedef struct _trace_event
+{
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+} trace_event_t;
+
+typedef struct _trace_buffer
+{
+    struct _trace_buffer *next;
+
+    size_t thread_id;
+    char thread_name[TRACE_THREAD_NAME_LENGTH];
+
+    volatile uint64_t head;
+    trace_event_t events[TRACE_BUFFER_CAPACITY];
+} trace_buffer_t;
+
+static trace_buffer_t *volatile _trace_buffers = NULL;
+static volatile size_t _trace_thread_count = 0;
+static volatile int _trace_is_initialized = 0;
+
+static uint64_t _trace_start_ticks;
+static uint64_t _trace_start_ns;
+
+/* Freeing the buffers starts a new generation, so that threads drop their cached buffer. */
+static volatile uint64_t _trace_generation = 0;
+static volatile size_t _trace_session_count = 0;
+
+static FILE *_trace_stream = NULL;
+static bool _trace_has_events = false;
+
+static __thread trace_buffer_t *_trace_thread_buffer = NULL;
+static __thread uint64_t _trace_thread_generation = 0;
+
+static inline uint64_t _trace_get_clock_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+}
+
+static inline uint64_t trace_get_ticks(void)
+{
+#if defined __x86_64__ || defined __i386__
+    return __builtin_ia32_rdtsc();
+#else
+    return _trace_get_clock_ns();
+#endif
+}
+
+static void _trace_initialize(void)
+{
+    if (0 != __sync_val_compare_and_swap(&_trace_is_initialized, 0, 1)) {
+        while (2 != _trace_is_initialized) { }
+
+        return;
+    }
+
+    _trace_start_ns = _trace_get_clock_ns();
+    _trace_start_ticks = trace_get_ticks();
+
+    __sync_synchronize();
+    _trace_is_initialized = 2;
+}
+
+static trace_buffer_t *_trace_get_thread_buffer(void)
+{
+    trace_buffer_t *buffer = _trace_thread_buffer;
+    if (NULL != buffer && _trace_thread_generation == _trace_generation) {
+        return buffer;
+    }
+
+    if (2 != _trace_is_initialized) {
+        _trace_initialize();
+    }
+
+    buffer = (trace_buffer_t *) calloc(1, sizeof(*buffer));
+    if (NULL == buffer) {
+        return buffer;
+    }
+
+    buffer->thread_id = __sync_fetch_and_add(&_trace_thread_count, 1);
+    snprintf(buffer->thread_name, sizeof(buffer->thread_name), "thread %zu", buffer->thread_id);
+
+    trace_buffer_t *head;
+    do {
+        head = _trace_buffers;
+        buffer->next = head;
+    } while (!__sync_bool_compare_and_swap(&_trace_buffers, head, buffer));
+
+    _trace_thread_buffer = buffer;
+    _trace_thread_generation = _trace_generation;
+
+    return buffer;
+}
+
+static inline void trace_set_thread_name(const char *name)
+{
+    trace_buffer_t *buffer = _trace_get_thread_buffer();
+    if (NULL == buffer) {
+        return;
+    }
+
+    snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
+}
+
+/* The name must outlive the trace (e.g., a string literal). */
+static inline void trace_record(const char *name, uint64_t begin, uint64_t end)
+{
+    trace_buffer_t *buffer = _trace_get_thread_buffer();
+    if (NULL == buffer) {
+        return;
+    }
+
+    uint64_t head = buffer->head;
+    trace_event_t *event = &buffer->events[head % TRACE_BUFFER_CAPACITY];
+    event->name = name;
+    event->begin = begin;
+    event->end = end;
+
+    /* Publishes the event to the writer. */
+    __sync_synchronize();
+    buffer->head = head + 1;
+}
+
+static void _trace_write_escaped(FILE *stream, const char *string)
+{
+    for (; '\0' != *string; ++string) {
+        char character = *string;
+        if ('"' == character || '\\' == character) {
+            fputc('\\', stream);
+            fputc(character, stream);
+        } else if ((unsigned char) character < 0x20) {
+            fputc(' ', stream);
+        } else {
+            fputc(character, stream);
+        }
+    }
+}
+
+static const char Trace_Footer[] = "\n]}\n";
+
+/*
+    Appends the events of all buffers to the trace file and frees the
+    buffers. Every thread that recorded events, except the caller, must have
+    been joined. The file is opened by the first call and keeps its name,
+    and the footer is rewritten every time, so the file is always complete.
+*/
+static void trace_write_file(const char *file_name)
+{
+    if (2 != _trace_is_initialized) {
+        return;
+    }
+
+    if (NULL == _trace_stream) {
+        _trace_stream = fopen(file_name, "w");
+        if (NULL == _trace_stream) {
+            fprintf(stderr, "Failed to create the trace file '%s'\n", file_name);
+            return;
+        }
+
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", _trace_stream);
+    }
+    FILE *stream = _trace_stream;
+
+    uint64_t elapsed_ticks = trace_get_ticks() - _trace_start_ticks;
+    uint64_t elapsed_ns = _trace_get_clock_ns() - _trace_start_ns;
+    double ns_per_tick =
+        0 == elapsed_ticks ?
+            1.0 : (double) elapsed_ns / (double) elapsed_ticks;
+
+    trace_buffer_t *buffers = __sync_lock_test_and_set(&_trace_buffers, NULL);
+    _trace_generation += 1;
+    __sync_synchronize();
+
+    for (trace_buffer_t *buffer = buffers; NULL != buffer;) {
+        fprintf(
+            stream,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"",
+            _trace_has_events ? ",\n" : "",
+            buffer->thread_id
+        );
+        _trace_write_escaped(stream, buffer->thread_name);
+        fputs("\"}}", stream);
+        _trace_has_events = true;
+
+        uint64_t head = buffer->head;
+        uint64_t first = head > TRACE_BUFFER_CAPACITY ? head - TRACE_BUFFER_CAPACITY : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            trace_event_t *event = &buffer->events[i % TRACE_BUFFER_CAPACITY];
+
+            double begin_us = (double) (int64_t) (event->begin - _trace_start_ticks) * ns_per_tick / 1000.0;
+            double duration_us = (double) (event->end - event->begin) * ns_per_tick / 1000.0;
+
+            fputs(",\n{\"name\":\"", stream);
+            _trace_write_escaped(stream, NULL != event->name ? event->name : "task");
+            fprintf(
+                stream,
+                "\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                buffer->thread_id,
+                begin_us,
+                duration_us
+            );
+        }
+
+        trace_buffer_t *next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+
+    /* The next call continues the event list over the footer. */
+    fputs(Trace_Footer, stream);
+    fflush(stream);
+    fseek(stream, -(long) (sizeof(Trace_Footer) - 1), SEEK_CUR);
+}
+
+static void trace_write(void)
+{
+    const char *file_name = getenv("THREADPOOL_TRACE_FILE");
+    if (NULL == file_name || '\0' == *file_name) {
+        file_name = Trace_Default_File_Name;
+    }
+
+    trace_write_file(file_name);
+}
+
+/* Called when a pool starts, before its workers record anything. */
+static inline void trace_begin_session(void)
+{
+    __sync_add_and_fetch(&_trace_session_count, 1);
+}
+
+/* Called after the workers of a pool are joined. The last session writes the trace. */
+static inline void trace_end_session(void)
+{
+    if (0 == __sync_sub_and_fetch(&_trace_session_count, 1)) {
+        trace_write();
+    }
+}
+
+#else // THREADPOOL_TRACING
+
+static inline uint64_t trace_get_ticks(void)
+{
+    return 0;
+}
+
+static inline void trace_set_thread_name(const char *name __attribute__((unused)))
+{
+}
+
+static inline void trace_record(
+                       const char *name __attribute__((unused)),
+                       uint64_t begin __attribute__((unused)),
+                       uint64_t end __attribute__((unused))
+                   )
+{
+}
+
+static inline void trace_write_file(const char *file_name __attribute__((unused)))
+{
+}
+
+static inline void trace_write(void)
+{
+}
+
+static inline void trace_begin_session(void)
+{
+}
+
+static inline void trace_end_session(void)
+{
+}
+
+#endif // THREADPOOL_TRACING
+
+#endif // TRACE_H
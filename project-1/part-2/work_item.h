@@ -1,13 +1,21 @@
 #ifndef WORK_ITEM_H
 #define WORK_ITEM_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 typedef struct work_item
 {
     void (*task)(void *task_data, void (*result_callback)(void *result));
     void *task_data;
     void (*result_callback)(void *result);
+    volatile ssize_t *pending_tasks;
+
+    size_t priority;
+    uint64_t enqueue_time;
+    const char *name;
 } work_item_t;
 
 static inline work_item_t *work_item_create(
@@ -24,6 +32,11 @@ static inline work_item_t *work_item_create(
     work_item->task = task;
     work_item->task_data = task_data;
     work_item->result_callback = result_callback;
+    work_item->pending_tasks = NULL;
+
+    work_item->priority = 0;
+    work_item->enqueue_time = 0;
+    work_item->name = NULL;
 
     return work_item;
 }
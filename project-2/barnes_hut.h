@@ -0,0 +1,712 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include "body.h"
+#include "morton.h"
+#include "thread_team.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Barnes–Hut quadtree for the O(N log N) force approximation.
+
+    All nodes live in one flat array that is reused between steps, so a
+    rebuild does not call malloc unless the tree outgrows the previous one.
+    Every node stores its own center of mass and total mass (for a leaf,
+    these are the position and mass of its body), so the force traversal
+    never has to look at the body array.
+
+    There are two builders:
+
+    * `quadtree_build` inserts the bodies one by one into a quadtree.
+    * `quadtree_build_morton` sorts the bodies by their Morton keys on a team
+      of threads and builds a binary radix tree over the sorted keys, where
+      every internal node is found independently from its position in the
+      sorted array (Karras, "Maximizing Parallelism in the Construction of
+      BVHs, Octrees, and k-d Trees", 2012). Two bits of a common key prefix
+      make one quadtree level, so every node is a quadtree cell (or half of
+      one), and the same traversal works for both trees. Leaves are stored
+      in Morton order, which keeps nearby bodies close in memory during the
+      traversal. Centers of mass are then accumulated level by level from
+      the deepest one, with every level split between the threads.
+
+    A cell of side s at distance d from a body is treated as a single point
+    mass if s / d < theta. A theta of zero opens every cell, which gives the
+    brute-force result. Note that the Unity simulator uses the inverse ratio
+    (d / s) for its Theta.
+*/
+
+#define QUADTREE_NO_NODE (-1)
+#define QUADTREE_MAX_DEPTH 48
+#define QUADTREE_STACK_SIZE 256
+#define QUADTREE_MINIMUM_CAPACITY 64
+
+/* Common prefixes are at most 64 bits long (32 key bits and 32 index bits). */
+#define QUADTREE_MORTON_MAX_LEVELS 66
+
+/* Quadtree Node */
+
+typedef struct _quadtree_node {
+    /* Center of mass */
+    float x, y;
+    float mass;
+
+    /* Side length of the cell */
+    float size;
+
+    int32_t children[4];
+
+    /* Index of the body for a leaf, QUADTREE_NO_NODE otherwise */
+    int32_t body;
+} quadtree_node_t;
+
+static inline bool quadtree_node_is_leaf(const quadtree_node_t *node)
+{
+    return QUADTREE_NO_NODE == node->children[0];
+}
+
+static inline void quadtree_node_init(quadtree_node_t *node, float size)
+{
+    node->x = node->y = 0.0f;
+    node->mass = 0.0f;
+    node->size = size;
+    node->children[0] = node->children[1] =
+        node->children[2] = node->children[3] = QUADTREE_NO_NODE;
+    node->body = QUADTREE_NO_NODE;
+}
+
+/* Quadtree */
+
+typedef struct _quadtree {
+    quadtree_node_t *nodes;
+    size_t node_count;
+    size_t node_capacity;
+
+    /* Root cell */
+    float min_x, min_y;
+    float size;
+
+    /* Scratch space of the Morton builder */
+    uint32_t *keys, *temporary_keys;
+    int32_t *order, *temporary_order;
+    int32_t *parents;
+    int32_t *levels;
+    size_t level_offsets[QUADTREE_MORTON_MAX_LEVELS + 1];
+    size_t scratch_capacity;
+
+    size_t *histograms;
+    float *bounds;
+    size_t scratch_thread_count;
+} quadtree_t;
+
+static inline quadtree_t *quadtree_init(quadtree_t *tree)
+{
+    tree->nodes = NULL;
+    tree->node_count = 0;
+    tree->node_capacity = 0;
+    tree->min_x = tree->min_y = 0.0f;
+    tree->size = 0.0f;
+
+    tree->keys = tree->temporary_keys = NULL;
+    tree->order = tree->temporary_order = NULL;
+    tree->parents = NULL;
+    tree->levels = NULL;
+    tree->scratch_capacity = 0;
+
+    tree->histograms = NULL;
+    tree->bounds = NULL;
+    tree->scratch_thread_count = 0;
+
+    return tree;
+}
+
+static void _quadtree_free_scratch(quadtree_t *tree)
+{
+    free(tree->keys);
+    free(tree->temporary_keys);
+    free(tree->order);
+    free(tree->temporary_order);
+    free(tree->parents);
+    free(tree->levels);
+    tree->keys = tree->temporary_keys = NULL;
+    tree->order = tree->temporary_order = NULL;
+    tree->parents = NULL;
+    tree->levels = NULL;
+    tree->scratch_capacity = 0;
+}
+
+static void quadtree_deinit(quadtree_t *tree)
+{
+    free(tree->nodes);
+    _quadtree_free_scratch(tree);
+    free(tree->histograms);
+    free(tree->bounds);
+    quadtree_init(tree);
+}
+
+static quadtree_t *quadtree_reserve(quadtree_t *tree, size_t node_count)
+{
+    if (node_count <= tree->node_capacity) {
+        return tree;
+    }
+
+    size_t capacity =
+        0 == tree->node_capacity ?
+            QUADTREE_MINIMUM_CAPACITY : tree->node_capacity;
+    while (capacity < node_count) {
+        capacity *= 2;
+    }
+
+    quadtree_node_t *nodes =
+        (quadtree_node_t *) realloc(tree->nodes, sizeof(*nodes) * capacity);
+    if (NULL == nodes) {
+        return NULL;
+    }
+
+    tree->nodes = nodes;
+    tree->node_capacity = capacity;
+
+    return tree;
+}
+
+/* Finds the smallest square that contains all bodies. */
+static void quadtree_fit_root_cell(quadtree_t *tree, const body_t *bodies, size_t body_count)
+{
+    float min_x = INFINITY, min_y = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY;
+    for (size_t i = 0; i < body_count; ++i) {
+        const body_t *body = &bodies[i];
+
+        min_x = fminf(min_x, body->x);
+        min_y = fminf(min_y, body->y);
+        max_x = fmaxf(max_x, body->x);
+        max_y = fmaxf(max_y, body->y);
+    }
+
+    float size = fmaxf(max_x - min_x, max_y - min_y);
+
+    /* Keeps the bodies on the maximum edges strictly inside the cell. */
+    size = size > 0.0f ? size * 1.0001f : 1.0f;
+
+    tree->min_x = min_x;
+    tree->min_y = min_y;
+    tree->size = size;
+}
+
+static inline int quadtree_get_quadrant(
+                      float x, float y,
+                      float min_x, float min_y,
+                      float half_size
+                  )
+{
+    return (x >= min_x + half_size ? 1 : 0) | (y >= min_y + half_size ? 2 : 0);
+}
+
+static quadtree_t *_quadtree_insert(quadtree_t *tree, const body_t *bodies, int32_t body_index)
+{
+    const body_t *body = &bodies[body_index];
+
+    int32_t node_index = 0;
+    float min_x = tree->min_x, min_y = tree->min_y;
+    float size = tree->size;
+
+    for (size_t depth = 0; ; ) {
+        quadtree_node_t *node = &tree->nodes[node_index];
+
+        if (!quadtree_node_is_leaf(node)) {
+            float half_size = size * 0.5f;
+            int quadrant = quadtree_get_quadrant(body->x, body->y, min_x, min_y, half_size);
+            if (quadrant & 1) { min_x += half_size; }
+            if (quadrant & 2) { min_y += half_size; }
+            size = half_size;
+
+            node_index = node->children[quadrant];
+            ++depth;
+
+            continue;
+        }
+
+        if (QUADTREE_NO_NODE == node->body) {
+            node->x = body->x;
+            node->y = body->y;
+            node->mass = body->mass;
+            node->body = body_index;
+
+            return tree;
+        }
+
+        if (QUADTREE_MAX_DEPTH <= depth) {
+            /* The bodies are too close to separate, so the leaf holds their sum. */
+            float mass = node->mass + body->mass;
+            if (mass > 0.0f) {
+                node->x = (node->x * node->mass + body->x * body->mass) / mass;
+                node->y = (node->y * node->mass + body->y * body->mass) / mass;
+            }
+            node->mass = mass;
+
+            return tree;
+        }
+
+        /* Splits the leaf and pushes its body one level down. */
+        size_t first_child = tree->node_count;
+        if (NULL == quadtree_reserve(tree, first_child + 4)) {
+            return NULL;
+        }
+        tree->node_count += 4;
+        node = &tree->nodes[node_index];
+
+        float half_size = size * 0.5f;
+        for (int i = 0; i < 4; ++i) {
+            quadtree_node_init(&tree->nodes[first_child + i], half_size);
+            node->children[i] = (int32_t) (first_child + i);
+        }
+
+        int quadrant = quadtree_get_quadrant(node->x, node->y, min_x, min_y, half_size);
+        quadtree_node_t *child = &tree->nodes[first_child + quadrant];
+        child->x = node->x;
+        child->y = node->y;
+        child->mass = node->mass;
+        child->body = node->body;
+
+        node->body = QUADTREE_NO_NODE;
+    }
+}
+
+/* Children are always stored after their parents, so one backward pass is enough. */
+static void quadtree_accumulate_mass(quadtree_t *tree)
+{
+    for (size_t i = tree->node_count; i-- > 0; ) {
+        quadtree_node_t *node = &tree->nodes[i];
+        if (quadtree_node_is_leaf(node)) {
+            continue;
+        }
+
+        float mass = 0.0f, x = 0.0f, y = 0.0f;
+        for (int j = 0; j < 4; ++j) {
+            const quadtree_node_t *child = &tree->nodes[node->children[j]];
+
+            mass += child->mass;
+            x += child->x * child->mass;
+            y += child->y * child->mass;
+        }
+
+        node->mass = mass;
+        if (mass > 0.0f) {
+            node->x = x / mass;
+            node->y = y / mass;
+        }
+    }
+}
+
+static quadtree_t *quadtree_build(quadtree_t *tree, const body_t *bodies, size_t body_count)
+{
+    /* A tree of N bodies usually needs about 2N nodes. */
+    if (NULL == quadtree_reserve(tree, body_count * 2 + 1)) {
+        return NULL;
+    }
+
+    quadtree_fit_root_cell(tree, bodies, body_count);
+
+    tree->node_count = 1;
+    quadtree_node_init(&tree->nodes[0], tree->size);
+
+    for (size_t i = 0; i < body_count; ++i) {
+        if (NULL == _quadtree_insert(tree, bodies, (int32_t) i)) {
+            return NULL;
+        }
+    }
+
+    quadtree_accumulate_mass(tree);
+
+    return tree;
+}
+
+/* Morton Builder */
+
+static quadtree_t *_quadtree_reserve_scratch(
+                       quadtree_t *tree,
+                       size_t body_count,
+                       size_t thread_count
+                   )
+{
+    if (body_count > tree->scratch_capacity) {
+        _quadtree_free_scratch(tree);
+
+        tree->keys = (uint32_t *) malloc(sizeof(*tree->keys) * body_count);
+        tree->temporary_keys = (uint32_t *) malloc(sizeof(*tree->temporary_keys) * body_count);
+        tree->order = (int32_t *) malloc(sizeof(*tree->order) * body_count);
+        tree->temporary_order = (int32_t *) malloc(sizeof(*tree->temporary_order) * body_count);
+        tree->parents = (int32_t *) malloc(sizeof(*tree->parents) * body_count * 2);
+        tree->levels = (int32_t *) malloc(sizeof(*tree->levels) * body_count);
+        if (NULL == tree->keys || NULL == tree->temporary_keys ||
+            NULL == tree->order || NULL == tree->temporary_order ||
+            NULL == tree->parents || NULL == tree->levels) {
+            _quadtree_free_scratch(tree);
+            return NULL;
+        }
+
+        tree->scratch_capacity = body_count;
+    }
+
+    if (thread_count > tree->scratch_thread_count) {
+        free(tree->histograms);
+        free(tree->bounds);
+
+        tree->histograms = (size_t *) malloc(sizeof(*tree->histograms) * MORTON_RADIX * thread_count);
+        tree->bounds = (float *) malloc(sizeof(*tree->bounds) * 4 * thread_count);
+        if (NULL == tree->histograms || NULL == tree->bounds) {
+            free(tree->histograms);
+            free(tree->bounds);
+            tree->histograms = NULL;
+            tree->bounds = NULL;
+            tree->scratch_thread_count = 0;
+
+            return NULL;
+        }
+
+        tree->scratch_thread_count = thread_count;
+    }
+
+    return tree;
+}
+
+/* Length of the common prefix of the keys at i and j, or -1 if j is out of range. */
+static inline int _quadtree_common_prefix(
+                      const uint32_t *keys,
+                      int64_t count,
+                      int64_t i,
+                      int64_t j
+                  )
+{
+    if (j < 0 || j >= count) {
+        return -1;
+    }
+
+    uint32_t first = keys[i], second = keys[j];
+    if (first == second) {
+        /* Equal keys are told apart by their positions. */
+        return MORTON_KEY_BITS + __builtin_clz((uint32_t) i ^ (uint32_t) j);
+    }
+
+    return __builtin_clz(first ^ second);
+}
+
+static void _quadtree_build_internal_node(quadtree_t *tree, int64_t count, int64_t i)
+{
+    const uint32_t *keys = tree->keys;
+
+    /* The direction of the range that starts at i */
+    int64_t direction =
+        _quadtree_common_prefix(keys, count, i, i + 1) -
+            _quadtree_common_prefix(keys, count, i, i - 1) > 0 ? 1 : -1;
+
+    /* The other end of the range */
+    int minimum_prefix = _quadtree_common_prefix(keys, count, i, i - direction);
+    int64_t maximum_length = 2;
+    while (_quadtree_common_prefix(keys, count, i, i + maximum_length * direction) > minimum_prefix) {
+        maximum_length *= 2;
+    }
+
+    int64_t length = 0;
+    for (int64_t step = maximum_length / 2; step >= 1; step /= 2) {
+        if (_quadtree_common_prefix(keys, count, i, i + (length + step) * direction) > minimum_prefix) {
+            length += step;
+        }
+    }
+    int64_t j = i + length * direction;
+
+    /* The split position, where the next key bit changes */
+    int node_prefix = _quadtree_common_prefix(keys, count, i, j);
+    int64_t split = 0;
+    for (int64_t step = length; step > 1; ) {
+        step = (step + 1) / 2;
+        if (_quadtree_common_prefix(keys, count, i, i + (split + step) * direction) > node_prefix) {
+            split += step;
+        }
+    }
+    int64_t gamma = i + split * direction + (direction < 0 ? -1 : 0);
+
+    int64_t first = i < j ? i : j;
+    int64_t last = i < j ? j : i;
+    int64_t leaf_offset = count - 1;
+
+    int32_t left = (int32_t) (first == gamma ? leaf_offset + gamma : gamma);
+    int32_t right = (int32_t) (last == gamma + 1 ? leaf_offset + gamma + 1 : gamma + 1);
+
+    quadtree_node_t *node = &tree->nodes[i];
+    int level = (node_prefix < MORTON_KEY_BITS ? node_prefix : MORTON_KEY_BITS) / 2;
+    quadtree_node_init(node, ldexpf(tree->size, -level));
+    node->children[0] = left;
+    node->children[1] = right;
+
+    tree->parents[left] = (int32_t) i;
+    tree->parents[right] = (int32_t) i;
+}
+
+typedef struct _quadtree_morton_build
+{
+    quadtree_t *tree;
+    const body_t *bodies;
+    size_t body_count;
+    thread_team_t *team;
+} quadtree_morton_build_t;
+
+static void _quadtree_build_morton_task(void *data, size_t thread_index, size_t thread_count)
+{
+    quadtree_morton_build_t *build = (quadtree_morton_build_t *) data;
+    quadtree_t *tree = build->tree;
+    const body_t *bodies = build->bodies;
+    size_t count = build->body_count;
+    thread_team_t *team = build->team;
+
+    size_t begin, end;
+    thread_team_split(count, thread_index, thread_count, &begin, &end);
+
+    /* Bounds */
+
+    float *bounds = &tree->bounds[thread_index * 4];
+    bounds[0] = bounds[1] = INFINITY;
+    bounds[2] = bounds[3] = -INFINITY;
+    for (size_t i = begin; i < end; ++i) {
+        bounds[0] = fminf(bounds[0], bodies[i].x);
+        bounds[1] = fminf(bounds[1], bodies[i].y);
+        bounds[2] = fmaxf(bounds[2], bodies[i].x);
+        bounds[3] = fmaxf(bounds[3], bodies[i].y);
+    }
+
+    thread_team_barrier(team);
+
+    if (0 == thread_index) {
+        float min_x = INFINITY, min_y = INFINITY;
+        float max_x = -INFINITY, max_y = -INFINITY;
+        for (size_t i = 0; i < thread_count; ++i) {
+            min_x = fminf(min_x, tree->bounds[i * 4 + 0]);
+            min_y = fminf(min_y, tree->bounds[i * 4 + 1]);
+            max_x = fmaxf(max_x, tree->bounds[i * 4 + 2]);
+            max_y = fmaxf(max_y, tree->bounds[i * 4 + 3]);
+        }
+
+        float size = fmaxf(max_x - min_x, max_y - min_y);
+        tree->min_x = min_x;
+        tree->min_y = min_y;
+        tree->size = size > 0.0f ? size * 1.0001f : 1.0f;
+    }
+
+    thread_team_barrier(team);
+
+    /* Keys */
+
+    for (size_t i = begin; i < end; ++i) {
+        tree->keys[i] =
+            morton_encode(
+                morton_quantize(bodies[i].x, tree->min_x, tree->size),
+                morton_quantize(bodies[i].y, tree->min_y, tree->size)
+            );
+        tree->order[i] = (int32_t) i;
+    }
+
+    thread_team_barrier(team);
+
+    morton_sort(
+        tree->keys, tree->order,
+        tree->temporary_keys, tree->temporary_order,
+        count,
+        tree->histograms,
+        team, thread_index, thread_count
+    );
+
+    /* Leaves in Morton order */
+
+    size_t leaf_offset = count - 1;
+    for (size_t i = begin; i < end; ++i) {
+        const body_t *body = &bodies[tree->order[i]];
+
+        quadtree_node_t *leaf = &tree->nodes[leaf_offset + i];
+        quadtree_node_init(leaf, 0.0f);
+        leaf->x = body->x;
+        leaf->y = body->y;
+        leaf->mass = body->mass;
+        leaf->body = tree->order[i];
+    }
+
+    /* Internal nodes */
+
+    size_t internal_begin, internal_end;
+    thread_team_split(count - 1, thread_index, thread_count, &internal_begin, &internal_end);
+    for (size_t i = internal_begin; i < internal_end; ++i) {
+        _quadtree_build_internal_node(tree, (int64_t) count, (int64_t) i);
+    }
+    if (0 == thread_index) {
+        tree->parents[0] = QUADTREE_NO_NODE;
+    }
+
+    thread_team_barrier(team);
+
+    /* Depths of internal nodes, kept in `temporary_order` */
+
+    int32_t *depths = tree->temporary_order;
+    for (size_t i = internal_begin; i < internal_end; ++i) {
+        int32_t depth = 0;
+        for (int32_t node = tree->parents[i]; QUADTREE_NO_NODE != node; node = tree->parents[node]) {
+            ++depth;
+        }
+        depths[i] = depth;
+    }
+
+    thread_team_barrier(team);
+
+    if (0 == thread_index) {
+        size_t *offsets = tree->level_offsets;
+        memset(offsets, 0, sizeof(tree->level_offsets));
+        for (size_t i = 0; i < count - 1; ++i) {
+            offsets[depths[i] + 1] += 1;
+        }
+        for (size_t level = 1; level <= QUADTREE_MORTON_MAX_LEVELS; ++level) {
+            offsets[level] += offsets[level - 1];
+        }
+
+        size_t positions[QUADTREE_MORTON_MAX_LEVELS];
+        memcpy(positions, offsets, sizeof(positions));
+        for (size_t i = 0; i < count - 1; ++i) {
+            tree->levels[positions[depths[i]]++] = (int32_t) i;
+        }
+    }
+
+    thread_team_barrier(team);
+
+    /* Centers of mass, from the deepest level up */
+
+    for (size_t level = QUADTREE_MORTON_MAX_LEVELS; level-- > 0; ) {
+        size_t level_begin = tree->level_offsets[level];
+        size_t level_count = tree->level_offsets[level + 1] - level_begin;
+        if (0 == level_count) {
+            continue;
+        }
+
+        size_t node_begin, node_end;
+        thread_team_split(level_count, thread_index, thread_count, &node_begin, &node_end);
+        for (size_t i = node_begin; i < node_end; ++i) {
+            quadtree_node_t *node = &tree->nodes[tree->levels[level_begin + i]];
+            const quadtree_node_t *left = &tree->nodes[node->children[0]];
+            const quadtree_node_t *right = &tree->nodes[node->children[1]];
+
+            float mass = left->mass + right->mass;
+            node->mass = mass;
+            if (mass > 0.0f) {
+                node->x = (left->x * left->mass + right->x * right->mass) / mass;
+                node->y = (left->y * left->mass + right->y * right->mass) / mass;
+            } else {
+                node->x = (left->x + right->x) * 0.5f;
+                node->y = (left->y + right->y) * 0.5f;
+            }
+        }
+
+        thread_team_barrier(team);
+    }
+}
+
+static quadtree_t *quadtree_build_morton(
+                       quadtree_t *tree,
+                       const body_t *bodies,
+                       size_t body_count,
+                       thread_team_t *team
+                   )
+{
+    if (2 > body_count) {
+        return quadtree_build(tree, bodies, body_count);
+    }
+
+    size_t thread_count = thread_team_get_thread_count(team);
+    if (NULL == quadtree_reserve(tree, body_count * 2 - 1) ||
+        NULL == _quadtree_reserve_scratch(tree, body_count, thread_count)) {
+        return NULL;
+    }
+    tree->node_count = body_count * 2 - 1;
+
+    quadtree_morton_build_t build = {
+        .tree = tree,
+        .bodies = bodies,
+        .body_count = body_count,
+        .team = team
+    };
+    thread_team_run(team, _quadtree_build_morton_task, &build);
+
+    return tree;
+}
+
+/* Force */
+
+/*
+    Walks the tree with an explicit stack. The body itself is skipped, the
+    same as in the brute-force loop.
+*/
+static void quadtree_calculate_acceleration(
+                const quadtree_t *tree,
+                size_t body_index,
+                float x, float y,
+                float theta,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    float theta_squared = theta * theta;
+    float total_ax = 0.0f, total_ay = 0.0f;
+
+    int32_t stack[QUADTREE_STACK_SIZE];
+    size_t stack_size = 0;
+    if (0 < tree->node_count) {
+        stack[stack_size++] = 0;
+    }
+
+    while (0 < stack_size) {
+        const quadtree_node_t *node = &tree->nodes[stack[--stack_size]];
+        if (0.0f == node->mass) {
+            continue;
+        }
+
+        float r_x = node->x - x;
+        float r_y = node->y - y;
+        float distance_squared = r_x * r_x + r_y * r_y;
+
+        bool is_leaf = quadtree_node_is_leaf(node);
+        if (is_leaf) {
+            if ((int32_t) body_index == node->body) {
+                continue;
+            }
+        } else if (node->size * node->size >= theta_squared * distance_squared) {
+            for (int i = 0; i < 4; ++i) {
+                int32_t child = node->children[i];
+                if (QUADTREE_NO_NODE != child) {
+                    stack[stack_size++] = child;
+                }
+            }
+
+            continue;
+        }
+
+        float softened_distance_squared =
+            distance_squared + softening_length_squared;
+        if (0.0f == softened_distance_squared) {
+            continue;
+        }
+
+        float distance_squared_cubed =
+            softened_distance_squared *
+                softened_distance_squared *
+                softened_distance_squared;
+        float scale =
+            node->mass / sqrtf(distance_squared_cubed);
+
+        total_ax += r_x * scale;
+        total_ay += r_y * scale;
+    }
+
+    *ax = total_ax;
+    *ay = total_ay;
+}
+
+#endif // BARNES_HUT_H
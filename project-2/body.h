@@ -0,0 +1,13 @@
+#ifndef BODY_H
+#define BODY_H
+
+/* Types */
+
+typedef struct _body {
+    float x, y;
+    float ax, ay;
+    float vx, vy;
+    float mass;
+} body_t;
+
+#endif // BODY_H
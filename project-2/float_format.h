@@ -0,0 +1,129 @@
+#ifndef FLOAT_FORMAT_H
+#define FLOAT_FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+    Formats floats exactly like printf("%f"): six decimals, rounded half
+    to even from the exact binary value, and a minus sign for every
+    negative value including -0.000000.
+
+    A float is m * 2^e with a 24-bit integer m. For e < 0, the six
+    decimals are m * 10^6 / 2^-e rounded to an integer, which fits in 64
+    bits. For 0 <= e <= 39, the value is the integer m << e. Larger
+    values, infinities and NaNs go to snprintf.
+*/
+
+/* Enough for "-" and the 39 integer digits of FLT_MAX with ".000000". */
+#define FLOAT_FORMAT_MAX_LENGTH 64
+
+#define Float_Format_Decimals 1000000u
+#define Float_Format_Max_Fast_Exponent 39
+
+static const char Float_Format_Digit_Pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Writes the decimal digits of `value` and returns the end. */
+static inline char *_float_format_integer(char *buffer, uint64_t value)
+{
+    char digits[20];
+    char *digit = digits + sizeof(digits);
+
+    while (value >= 100) {
+        unsigned int pair = (unsigned int) (value % 100);
+        value /= 100;
+        digit -= 2;
+        memcpy(digit, &Float_Format_Digit_Pairs[2 * pair], 2);
+    }
+    if (value >= 10) {
+        digit -= 2;
+        memcpy(digit, &Float_Format_Digit_Pairs[2 * value], 2);
+    } else {
+        *--digit = (char) ('0' + value);
+    }
+
+    size_t length = (size_t) (digits + sizeof(digits) - digit);
+    memcpy(buffer, digit, length);
+
+    return buffer + length;
+}
+
+/* Writes exactly six digits of `value` < 10^6 and returns the end. */
+static inline char *_float_format_decimals(char *buffer, uint32_t value)
+{
+    unsigned int high = value / 10000;
+    unsigned int middle = value / 100 % 100;
+    unsigned int low = value % 100;
+
+    memcpy(buffer, &Float_Format_Digit_Pairs[2 * high], 2);
+    memcpy(buffer + 2, &Float_Format_Digit_Pairs[2 * middle], 2);
+    memcpy(buffer + 4, &Float_Format_Digit_Pairs[2 * low], 2);
+
+    return buffer + 6;
+}
+
+/*
+    Writes `value` to `buffer`, which must hold FLOAT_FORMAT_MAX_LENGTH
+    characters, without a terminating zero. Returns the end of the text.
+*/
+static char *float_format_fixed(char *buffer, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t biased_exponent = (bits >> 23) & 0xFFu;
+    uint64_t mantissa = bits & 0x7FFFFFu;
+    int exponent = -149;
+    if (0 != biased_exponent) {
+        mantissa |= 0x800000u;
+        exponent = (int) biased_exponent - 150;
+    }
+
+    if (0xFFu == biased_exponent || exponent > Float_Format_Max_Fast_Exponent) {
+        int length = snprintf(buffer, FLOAT_FORMAT_MAX_LENGTH, "%f", value);
+
+        return buffer + (length < 0 ? 0 : length);
+    }
+
+    uint64_t integer = 0;
+    uint32_t decimals = 0;
+    if (exponent >= 0) {
+        integer = mantissa << exponent;
+    } else if (exponent > -64) {
+        unsigned int shift = (unsigned int) -exponent;
+        uint64_t scaled = mantissa * Float_Format_Decimals;
+        uint64_t rounded = scaled >> shift;
+        uint64_t remainder = scaled - (rounded << shift);
+        uint64_t half = (uint64_t) 1 << (shift - 1);
+        if (remainder > half || (remainder == half && 0 != (rounded & 1))) {
+            ++rounded;
+        }
+
+        integer = rounded / Float_Format_Decimals;
+        decimals = (uint32_t) (rounded % Float_Format_Decimals);
+    }
+    /* Below 2^-64, m * 10^6 is less than half of the divisor, so it rounds to zero. */
+
+    if (0 != (bits >> 31)) {
+        *buffer++ = '-';
+    }
+    buffer = _float_format_integer(buffer, integer);
+    *buffer++ = '.';
+
+    return _float_format_decimals(buffer, decimals);
+}
+
+#endif // FLOAT_FORMAT_H
@@ -0,0 +1,946 @@
+#ifndef FORCE_KERNELS_H
+#define FORCE_KERNELS_H
+
+#include "body.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+    #define FORCE_KERNELS_X86 1
+    #include <immintrin.h>
+#endif
+
+/*
+    All-pairs gravity kernels. Every kernel adds the accelerations of the
+    targets [begin, end) caused by all sources to ax[i - begin] and
+    ay[i - begin], so the caller has to clear them first (or can sum several
+    source blocks into them).
+
+    * Reference: the original loop over `body_t` structures.
+    * Scalar: the same math over a structure of arrays (SoA).
+    * AVX2 and AVX-512: 8 or 16 sources per iteration, with the inverse
+      square root computed by `rsqrt` and refined by one Newton-Raphson
+      step (about 22 correct bits instead of 12).
+
+    Pairs at zero distance contribute nothing, which skips the body itself
+    without comparing indices.
+
+    Symmetric kernels use Newton's third law: every pair (i, j) with i < j is
+    evaluated once, and the inverse cube of its distance is used for both
+    bodies. They walk the rows [row_begin, row_end) of the upper triangle of
+    the pair matrix and add to accumulators indexed by body for all bodies
+    (`padded_count` floats), since a row touches every body after it.
+    `force_kernel_split_pairs` cuts the triangle into parts with equal
+    numbers of pairs.
+
+    `force_kernel_tiled` runs the SoA kernels over cache-sized tiles of
+    targets and sources (see `force_kernel_tiling_t`).
+*/
+
+#define BODIES_SOA_ALIGNMENT 64
+#define BODIES_SOA_PADDING 16
+
+typedef enum _force_kernel {
+    FORCE_KERNEL_REFERENCE,
+    FORCE_KERNEL_SCALAR,
+    FORCE_KERNEL_AVX2,
+    FORCE_KERNEL_AVX512,
+    FORCE_KERNEL_COUNT,
+    FORCE_KERNEL_AUTO = FORCE_KERNEL_COUNT
+} force_kernel_t;
+
+static const char *Force_Kernel_Names[] = {
+    "reference",
+    "scalar",
+    "avx2",
+    "avx512",
+    "auto"
+};
+
+/* Bodies SoA */
+
+/*
+    Arrays are padded with massless bodies to a multiple of
+    BODIES_SOA_PADDING, so vector kernels need no remainder loop. The three
+    arrays are parts of one allocation, in the order x, y, mass, so the
+    whole block can be sent as `BODIES_SOA_FIELDS * padded_count` floats
+    starting at `x`.
+*/
+#define BODIES_SOA_FIELDS 3
+
+typedef struct _bodies_soa {
+    float *x, *y;
+    float *mass;
+    size_t count;
+    size_t padded_count;
+    size_t capacity;
+} bodies_soa_t;
+
+static inline bodies_soa_t *bodies_soa_init(bodies_soa_t *soa)
+{
+    soa->x = soa->y = soa->mass = NULL;
+    soa->count = soa->padded_count = soa->capacity = 0;
+
+    return soa;
+}
+
+static void bodies_soa_deinit(bodies_soa_t *soa)
+{
+    free(soa->x);
+    bodies_soa_init(soa);
+}
+
+static inline float *bodies_soa_allocate_array(size_t count)
+{
+    void *memory = NULL;
+    if (0 != posix_memalign(&memory, BODIES_SOA_ALIGNMENT, sizeof(float) * count)) {
+        return NULL;
+    }
+
+    return (float *) memory;
+}
+
+static inline size_t bodies_soa_get_padded_count(size_t count)
+{
+    return (count + BODIES_SOA_PADDING - 1) / BODIES_SOA_PADDING * BODIES_SOA_PADDING;
+}
+
+/* Sets the number of bodies. The new padding is cleared, the old contents are not kept. */
+static bodies_soa_t *bodies_soa_resize(bodies_soa_t *soa, size_t count)
+{
+    size_t padded_count = bodies_soa_get_padded_count(count);
+
+    if (padded_count > soa->capacity) {
+        bodies_soa_deinit(soa);
+
+        soa->x = bodies_soa_allocate_array(BODIES_SOA_FIELDS * padded_count);
+        if (NULL == soa->x) {
+            return NULL;
+        }
+
+        soa->capacity = padded_count;
+    }
+
+    soa->y = soa->x + padded_count;
+    soa->mass = soa->y + padded_count;
+
+    for (size_t i = count; i < padded_count; ++i) {
+        soa->x[i] = soa->y[i] = soa->mass[i] = 0.0f;
+    }
+
+    soa->count = count;
+    soa->padded_count = padded_count;
+
+    return soa;
+}
+
+static bodies_soa_t *bodies_soa_load(bodies_soa_t *soa, const body_t *bodies, size_t count)
+{
+    if (NULL == bodies_soa_resize(soa, count)) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        soa->x[i] = bodies[i].x;
+        soa->y[i] = bodies[i].y;
+        soa->mass[i] = bodies[i].mass;
+    }
+
+    return soa;
+}
+
+/* Reference */
+
+static inline void force_kernel_reference_pair(
+                       const body_t *first_body, const body_t *second_body,
+                       float softening_length_squared,
+                       float *ax, float *ay
+                   )
+{
+    float galactic_plane_r_x =
+        second_body->x - first_body->x;
+    float galactic_plane_r_y =
+        second_body->y - first_body->y;
+
+    float distance_squared =
+        (galactic_plane_r_x * galactic_plane_r_x  +
+         galactic_plane_r_y * galactic_plane_r_y) +
+            softening_length_squared;
+    float distance_squared_cubed =
+        distance_squared * distance_squared * distance_squared;
+    float inverse =
+        1.0f / sqrtf(distance_squared_cubed);
+    float scale =
+        second_body->mass * inverse;
+
+    *ax = galactic_plane_r_x * scale;
+    *ay = galactic_plane_r_y * scale;
+}
+
+static void force_kernel_reference(
+                const body_t *bodies, size_t body_count,
+                size_t begin, size_t end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    for (size_t i = begin; i < end; ++i) {
+        const body_t *first_body = &bodies[i];
+
+        float total_ax = 0.0f, total_ay = 0.0f;
+        for (size_t j = 0; j < body_count; ++j) {
+            const body_t *second_body = &bodies[j];
+            if (first_body == second_body) {
+                continue;
+            }
+
+            float body_ax, body_ay;
+            force_kernel_reference_pair(
+                first_body, second_body,
+                softening_length_squared,
+                &body_ax, &body_ay
+            );
+
+            total_ax += body_ax;
+            total_ay += body_ay;
+        }
+
+        ax[i - begin] += total_ax;
+        ay[i - begin] += total_ay;
+    }
+}
+
+/* Scalar */
+
+/*
+    Adds the accelerations of the targets [begin, end) caused by the
+    sources [source_begin, source_end) to ax[i - begin] and ay[i - begin].
+*/
+static void _force_kernel_block_scalar(
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const float *source_x, const float *source_y, const float *source_mass,
+                size_t source_begin, size_t source_end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    for (size_t i = begin; i < end; ++i) {
+        float x = target_x[i], y = target_y[i];
+
+        float total_ax = 0.0f, total_ay = 0.0f;
+        for (size_t j = source_begin; j < source_end; ++j) {
+            float r_x = source_x[j] - x;
+            float r_y = source_y[j] - y;
+            float r_squared = r_x * r_x + r_y * r_y;
+            if (0.0f == r_squared) {
+                continue;
+            }
+
+            float distance_squared = r_squared + softening_length_squared;
+            float scale =
+                source_mass[j] /
+                    sqrtf(distance_squared * distance_squared * distance_squared);
+
+            total_ax += r_x * scale;
+            total_ay += r_y * scale;
+        }
+
+        ax[i - begin] += total_ax;
+        ay[i - begin] += total_ay;
+    }
+}
+
+static void force_kernel_scalar(
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const bodies_soa_t *sources,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    _force_kernel_block_scalar(
+        target_x, target_y,
+        begin, end,
+        sources->x, sources->y, sources->mass,
+        0, sources->count,
+        softening_length_squared,
+        ax, ay
+    );
+}
+
+/* Symmetric Scalar */
+
+static inline void _force_kernel_symmetric_pair(
+                       const bodies_soa_t *bodies,
+                       size_t i, size_t j,
+                       float softening_length_squared,
+                       float *total_ax, float *total_ay,
+                       float *ax, float *ay
+                   )
+{
+    float r_x = bodies->x[j] - bodies->x[i];
+    float r_y = bodies->y[j] - bodies->y[i];
+    float r_squared = r_x * r_x + r_y * r_y;
+    if (0.0f == r_squared) {
+        return;
+    }
+
+    float distance_squared = r_squared + softening_length_squared;
+    float inverse_cubed = 1.0f / sqrtf(distance_squared * distance_squared * distance_squared);
+
+    float first_scale = bodies->mass[j] * inverse_cubed;
+    float second_scale = bodies->mass[i] * inverse_cubed;
+
+    *total_ax += r_x * first_scale;
+    *total_ay += r_y * first_scale;
+    ax[j] -= r_x * second_scale;
+    ay[j] -= r_y * second_scale;
+}
+
+static void force_kernel_symmetric_scalar(
+                const bodies_soa_t *bodies,
+                size_t row_begin, size_t row_end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    for (size_t i = row_begin; i < row_end; ++i) {
+        float total_ax = 0.0f, total_ay = 0.0f;
+        for (size_t j = i + 1; j < bodies->count; ++j) {
+            _force_kernel_symmetric_pair(
+                bodies,
+                i, j,
+                softening_length_squared,
+                &total_ax, &total_ay,
+                ax, ay
+            );
+        }
+
+        ax[i] += total_ax;
+        ay[i] += total_ay;
+    }
+}
+
+/* Returns the number of pairs (i, j), i < j, in the rows before `row`. */
+static inline uint64_t _force_kernel_pairs_before_row(uint64_t body_count, uint64_t row)
+{
+    return row * (body_count - 1) - row * (row - 1) / 2;
+}
+
+/* Splits the rows of the pair triangle into `part_count` parts of equal work. */
+static inline void force_kernel_split_pairs(
+                       size_t body_count,
+                       size_t part, size_t part_count,
+                       size_t *row_begin, size_t *row_end
+                   )
+{
+    if (2 > body_count) {
+        *row_begin = *row_end = 0;
+        return;
+    }
+
+    uint64_t row_count = body_count - 1;
+    uint64_t pair_count = _force_kernel_pairs_before_row(body_count, row_count);
+
+    size_t bounds[2];
+    for (size_t k = 0; k < 2; ++k) {
+        uint64_t target = (uint64_t) ((double) pair_count * (double) (part + k) / (double) part_count);
+
+        /* The first row that starts at or after the target pair */
+        uint64_t low = 0, high = row_count;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (_force_kernel_pairs_before_row(body_count, middle) < target) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        bounds[k] = (size_t) low;
+    }
+
+    *row_begin = bounds[0];
+    *row_end = part + 1 == part_count ? (size_t) row_count : bounds[1];
+}
+
+#ifdef FORCE_KERNELS_X86
+
+/* AVX2 */
+
+__attribute__((target("avx2,fma")))
+static inline float _force_kernel_avx2_sum(__m256 vector)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(vector), _mm256_extractf128_ps(vector, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+
+    return _mm_cvtss_f32(sum);
+}
+
+/* Adds the pull of eight sources on one target to the accumulators. */
+__attribute__((target("avx2,fma")))
+static inline void _force_kernel_avx2_accumulate(
+                       __m256 source_x, __m256 source_y, __m256 source_mass,
+                       __m256 x, __m256 y,
+                       __m256 softening,
+                       __m256 *total_ax, __m256 *total_ay
+                   )
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+
+    __m256 r_x = _mm256_sub_ps(source_x, x);
+    __m256 r_y = _mm256_sub_ps(source_y, y);
+    __m256 r_squared = _mm256_fmadd_ps(r_x, r_x, _mm256_mul_ps(r_y, r_y));
+    __m256 distance_squared = _mm256_add_ps(r_squared, softening);
+
+    /* inverse = rsqrt(d) * (1.5 - 0.5 * d * rsqrt(d)^2) */
+    __m256 inverse = _mm256_rsqrt_ps(distance_squared);
+    __m256 half_distance = _mm256_mul_ps(half, distance_squared);
+    inverse =
+        _mm256_mul_ps(
+            inverse,
+            _mm256_fnmadd_ps(
+                _mm256_mul_ps(half_distance, inverse), inverse,
+                three_halves
+            )
+        );
+
+    __m256 inverse_cubed = _mm256_mul_ps(_mm256_mul_ps(inverse, inverse), inverse);
+    __m256 scale = _mm256_mul_ps(source_mass, inverse_cubed);
+    scale = _mm256_and_ps(scale, _mm256_cmp_ps(r_squared, zero, _CMP_NEQ_OQ));
+
+    *total_ax = _mm256_fmadd_ps(r_x, scale, *total_ax);
+    *total_ay = _mm256_fmadd_ps(r_y, scale, *total_ay);
+}
+
+/*
+    Two targets share every load of the sources, which also gives the
+    processor two independent accumulation chains. The source range must
+    be a multiple of eight.
+*/
+__attribute__((target("avx2,fma")))
+static void _force_kernel_block_avx2(
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const float *source_x, const float *source_y, const float *source_mass,
+                size_t source_begin, size_t source_end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    const __m256 softening = _mm256_set1_ps(softening_length_squared);
+
+    size_t i = begin;
+    for (; i + 2 <= end; i += 2) {
+        const __m256 first_x = _mm256_set1_ps(target_x[i]);
+        const __m256 first_y = _mm256_set1_ps(target_y[i]);
+        const __m256 second_x = _mm256_set1_ps(target_x[i + 1]);
+        const __m256 second_y = _mm256_set1_ps(target_y[i + 1]);
+
+        __m256 first_ax = _mm256_setzero_ps(), first_ay = _mm256_setzero_ps();
+        __m256 second_ax = _mm256_setzero_ps(), second_ay = _mm256_setzero_ps();
+        for (size_t j = source_begin; j < source_end; j += 8) {
+            __m256 x = _mm256_load_ps(&source_x[j]);
+            __m256 y = _mm256_load_ps(&source_y[j]);
+            __m256 mass = _mm256_load_ps(&source_mass[j]);
+
+            _force_kernel_avx2_accumulate(x, y, mass, first_x, first_y, softening, &first_ax, &first_ay);
+            _force_kernel_avx2_accumulate(x, y, mass, second_x, second_y, softening, &second_ax, &second_ay);
+        }
+
+        ax[i - begin] += _force_kernel_avx2_sum(first_ax);
+        ay[i - begin] += _force_kernel_avx2_sum(first_ay);
+        ax[i + 1 - begin] += _force_kernel_avx2_sum(second_ax);
+        ay[i + 1 - begin] += _force_kernel_avx2_sum(second_ay);
+    }
+
+    for (; i < end; ++i) {
+        const __m256 x = _mm256_set1_ps(target_x[i]);
+        const __m256 y = _mm256_set1_ps(target_y[i]);
+
+        __m256 total_ax = _mm256_setzero_ps(), total_ay = _mm256_setzero_ps();
+        for (size_t j = source_begin; j < source_end; j += 8) {
+            _force_kernel_avx2_accumulate(
+                _mm256_load_ps(&source_x[j]),
+                _mm256_load_ps(&source_y[j]),
+                _mm256_load_ps(&source_mass[j]),
+                x, y,
+                softening,
+                &total_ax, &total_ay
+            );
+        }
+
+        ax[i - begin] += _force_kernel_avx2_sum(total_ax);
+        ay[i - begin] += _force_kernel_avx2_sum(total_ay);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void force_kernel_avx2(
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const bodies_soa_t *sources,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    _force_kernel_block_avx2(
+        target_x, target_y,
+        begin, end,
+        sources->x, sources->y, sources->mass,
+        0, sources->padded_count,
+        softening_length_squared,
+        ax, ay
+    );
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512f")))
+static inline void _force_kernel_avx512_accumulate(
+                       __m512 source_x, __m512 source_y, __m512 source_mass,
+                       __m512 x, __m512 y,
+                       __m512 softening,
+                       __m512 *total_ax, __m512 *total_ay
+                   )
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+
+    __m512 r_x = _mm512_sub_ps(source_x, x);
+    __m512 r_y = _mm512_sub_ps(source_y, y);
+    __m512 r_squared = _mm512_fmadd_ps(r_x, r_x, _mm512_mul_ps(r_y, r_y));
+    __m512 distance_squared = _mm512_add_ps(r_squared, softening);
+
+    __m512 inverse = _mm512_rsqrt14_ps(distance_squared);
+    __m512 half_distance = _mm512_mul_ps(half, distance_squared);
+    inverse =
+        _mm512_mul_ps(
+            inverse,
+            _mm512_fnmadd_ps(
+                _mm512_mul_ps(half_distance, inverse), inverse,
+                three_halves
+            )
+        );
+
+    __m512 inverse_cubed = _mm512_mul_ps(_mm512_mul_ps(inverse, inverse), inverse);
+    __mmask16 is_distinct = _mm512_cmp_ps_mask(r_squared, zero, _CMP_NEQ_OQ);
+    __m512 scale = _mm512_maskz_mul_ps(is_distinct, source_mass, inverse_cubed);
+
+    *total_ax = _mm512_fmadd_ps(r_x, scale, *total_ax);
+    *total_ay = _mm512_fmadd_ps(r_y, scale, *total_ay);
+}
+
+/* Four targets per pass over the sources. The source range must be a multiple of 16. */
+__attribute__((target("avx512f")))
+static void _force_kernel_block_avx512(
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const float *source_x, const float *source_y, const float *source_mass,
+                size_t source_begin, size_t source_end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    enum { Targets = 4 };
+
+    const __m512 softening = _mm512_set1_ps(softening_length_squared);
+
+    size_t i = begin;
+    for (; i + Targets <= end; i += Targets) {
+        __m512 x[Targets], y[Targets];
+        __m512 total_ax[Targets], total_ay[Targets];
+        for (int k = 0; k < Targets; ++k) {
+            x[k] = _mm512_set1_ps(target_x[i + k]);
+            y[k] = _mm512_set1_ps(target_y[i + k]);
+            total_ax[k] = total_ay[k] = _mm512_setzero_ps();
+        }
+
+        for (size_t j = source_begin; j < source_end; j += 16) {
+            __m512 sx = _mm512_load_ps(&source_x[j]);
+            __m512 sy = _mm512_load_ps(&source_y[j]);
+            __m512 mass = _mm512_load_ps(&source_mass[j]);
+
+            for (int k = 0; k < Targets; ++k) {
+                _force_kernel_avx512_accumulate(
+                    sx, sy, mass,
+                    x[k], y[k],
+                    softening,
+                    &total_ax[k], &total_ay[k]
+                );
+            }
+        }
+
+        for (int k = 0; k < Targets; ++k) {
+            ax[i + k - begin] += _mm512_reduce_add_ps(total_ax[k]);
+            ay[i + k - begin] += _mm512_reduce_add_ps(total_ay[k]);
+        }
+    }
+
+    for (; i < end; ++i) {
+        const __m512 x = _mm512_set1_ps(target_x[i]);
+        const __m512 y = _mm512_set1_ps(target_y[i]);
+
+        __m512 total_ax = _mm512_setzero_ps(), total_ay = _mm512_setzero_ps();
+        for (size_t j = source_begin; j < source_end; j += 16) {
+            _force_kernel_avx512_accumulate(
+                _mm512_load_ps(&source_x[j]),
+                _mm512_load_ps(&source_y[j]),
+                _mm512_load_ps(&source_mass[j]),
+                x, y,
+                softening,
+                &total_ax, &total_ay
+            );
+        }
+
+        ax[i - begin] += _mm512_reduce_add_ps(total_ax);
+        ay[i - begin] += _mm512_reduce_add_ps(total_ay);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void force_kernel_avx512(
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const bodies_soa_t *sources,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    _force_kernel_block_avx512(
+        target_x, target_y,
+        begin, end,
+        sources->x, sources->y, sources->mass,
+        0, sources->padded_count,
+        softening_length_squared,
+        ax, ay
+    );
+}
+
+/* Symmetric AVX2 */
+
+__attribute__((target("avx2,fma")))
+static void force_kernel_symmetric_avx2(
+                const bodies_soa_t *bodies,
+                size_t row_begin, size_t row_end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    const float *source_x = bodies->x;
+    const float *source_y = bodies->y;
+    const float *source_mass = bodies->mass;
+    size_t count = bodies->padded_count;
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 softening = _mm256_set1_ps(softening_length_squared);
+
+    for (size_t i = row_begin; i < row_end; ++i) {
+        float scalar_ax = 0.0f, scalar_ay = 0.0f;
+
+        /* Scalar pairs up to the first full vector */
+        size_t j = i + 1;
+        for (; j < count && 0 != j % 8; ++j) {
+            _force_kernel_symmetric_pair(
+                bodies,
+                i, j,
+                softening_length_squared,
+                &scalar_ax, &scalar_ay,
+                ax, ay
+            );
+        }
+
+        const __m256 x = _mm256_set1_ps(source_x[i]);
+        const __m256 y = _mm256_set1_ps(source_y[i]);
+        const __m256 mass = _mm256_set1_ps(source_mass[i]);
+
+        __m256 total_ax = zero, total_ay = zero;
+        for (; j < count; j += 8) {
+            __m256 r_x = _mm256_sub_ps(_mm256_load_ps(&source_x[j]), x);
+            __m256 r_y = _mm256_sub_ps(_mm256_load_ps(&source_y[j]), y);
+            __m256 r_squared = _mm256_fmadd_ps(r_x, r_x, _mm256_mul_ps(r_y, r_y));
+            __m256 distance_squared = _mm256_add_ps(r_squared, softening);
+
+            __m256 inverse = _mm256_rsqrt_ps(distance_squared);
+            __m256 half_distance = _mm256_mul_ps(half, distance_squared);
+            inverse =
+                _mm256_mul_ps(
+                    inverse,
+                    _mm256_fnmadd_ps(
+                        _mm256_mul_ps(half_distance, inverse), inverse,
+                        three_halves
+                    )
+                );
+
+            __m256 inverse_cubed = _mm256_mul_ps(_mm256_mul_ps(inverse, inverse), inverse);
+            inverse_cubed = _mm256_and_ps(inverse_cubed, _mm256_cmp_ps(r_squared, zero, _CMP_NEQ_OQ));
+
+            __m256 first_scale = _mm256_mul_ps(_mm256_load_ps(&source_mass[j]), inverse_cubed);
+            __m256 second_scale = _mm256_mul_ps(mass, inverse_cubed);
+
+            total_ax = _mm256_fmadd_ps(r_x, first_scale, total_ax);
+            total_ay = _mm256_fmadd_ps(r_y, first_scale, total_ay);
+
+            _mm256_storeu_ps(&ax[j], _mm256_fnmadd_ps(r_x, second_scale, _mm256_loadu_ps(&ax[j])));
+            _mm256_storeu_ps(&ay[j], _mm256_fnmadd_ps(r_y, second_scale, _mm256_loadu_ps(&ay[j])));
+        }
+
+        ax[i] += scalar_ax + _force_kernel_avx2_sum(total_ax);
+        ay[i] += scalar_ay + _force_kernel_avx2_sum(total_ay);
+    }
+}
+
+/* Symmetric AVX-512 */
+
+__attribute__((target("avx512f")))
+static void force_kernel_symmetric_avx512(
+                const bodies_soa_t *bodies,
+                size_t row_begin, size_t row_end,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    const float *source_x = bodies->x;
+    const float *source_y = bodies->y;
+    const float *source_mass = bodies->mass;
+    size_t count = bodies->padded_count;
+
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 softening = _mm512_set1_ps(softening_length_squared);
+
+    for (size_t i = row_begin; i < row_end; ++i) {
+        float scalar_ax = 0.0f, scalar_ay = 0.0f;
+
+        size_t j = i + 1;
+        for (; j < count && 0 != j % 16; ++j) {
+            _force_kernel_symmetric_pair(
+                bodies,
+                i, j,
+                softening_length_squared,
+                &scalar_ax, &scalar_ay,
+                ax, ay
+            );
+        }
+
+        const __m512 x = _mm512_set1_ps(source_x[i]);
+        const __m512 y = _mm512_set1_ps(source_y[i]);
+        const __m512 mass = _mm512_set1_ps(source_mass[i]);
+
+        __m512 total_ax = zero, total_ay = zero;
+        for (; j < count; j += 16) {
+            __m512 r_x = _mm512_sub_ps(_mm512_load_ps(&source_x[j]), x);
+            __m512 r_y = _mm512_sub_ps(_mm512_load_ps(&source_y[j]), y);
+            __m512 r_squared = _mm512_fmadd_ps(r_x, r_x, _mm512_mul_ps(r_y, r_y));
+            __m512 distance_squared = _mm512_add_ps(r_squared, softening);
+
+            __m512 inverse = _mm512_rsqrt14_ps(distance_squared);
+            __m512 half_distance = _mm512_mul_ps(half, distance_squared);
+            inverse =
+                _mm512_mul_ps(
+                    inverse,
+                    _mm512_fnmadd_ps(
+                        _mm512_mul_ps(half_distance, inverse), inverse,
+                        three_halves
+                    )
+                );
+
+            __mmask16 is_distinct = _mm512_cmp_ps_mask(r_squared, zero, _CMP_NEQ_OQ);
+            __m512 inverse_cubed =
+                _mm512_maskz_mul_ps(is_distinct, _mm512_mul_ps(inverse, inverse), inverse);
+
+            __m512 first_scale = _mm512_mul_ps(_mm512_load_ps(&source_mass[j]), inverse_cubed);
+            __m512 second_scale = _mm512_mul_ps(mass, inverse_cubed);
+
+            total_ax = _mm512_fmadd_ps(r_x, first_scale, total_ax);
+            total_ay = _mm512_fmadd_ps(r_y, first_scale, total_ay);
+
+            _mm512_storeu_ps(&ax[j], _mm512_fnmadd_ps(r_x, second_scale, _mm512_loadu_ps(&ax[j])));
+            _mm512_storeu_ps(&ay[j], _mm512_fnmadd_ps(r_y, second_scale, _mm512_loadu_ps(&ay[j])));
+        }
+
+        ax[i] += scalar_ax + _mm512_reduce_add_ps(total_ax);
+        ay[i] += scalar_ay + _mm512_reduce_add_ps(total_ay);
+    }
+}
+
+#endif // FORCE_KERNELS_X86
+
+/* Dispatch */
+
+typedef void (*force_kernel_function_t)(
+                 const float *target_x, const float *target_y,
+                 size_t begin, size_t end,
+                 const bodies_soa_t *sources,
+                 float softening_length_squared,
+                 float *ax, float *ay
+             );
+
+static bool force_kernel_is_supported(force_kernel_t kernel)
+{
+    switch (kernel) {
+        case FORCE_KERNEL_REFERENCE:
+        case FORCE_KERNEL_SCALAR:
+            return true;
+#ifdef FORCE_KERNELS_X86
+        case FORCE_KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case FORCE_KERNEL_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+/* Resolves FORCE_KERNEL_AUTO to the widest kernel that the CPU supports. */
+static force_kernel_t force_kernel_resolve(force_kernel_t kernel)
+{
+    if (FORCE_KERNEL_AUTO != kernel) {
+        return kernel;
+    }
+
+    if (force_kernel_is_supported(FORCE_KERNEL_AVX512)) {
+        return FORCE_KERNEL_AVX512;
+    }
+    if (force_kernel_is_supported(FORCE_KERNEL_AVX2)) {
+        return FORCE_KERNEL_AVX2;
+    }
+
+    return FORCE_KERNEL_SCALAR;
+}
+
+typedef void (*force_kernel_symmetric_function_t)(
+                 const bodies_soa_t *bodies,
+                 size_t row_begin, size_t row_end,
+                 float softening_length_squared,
+                 float *ax, float *ay
+             );
+
+/* The reference kernel has no symmetric version and falls back to the scalar one. */
+static inline force_kernel_symmetric_function_t force_kernel_get_symmetric_function(force_kernel_t kernel)
+{
+    switch (kernel) {
+#ifdef FORCE_KERNELS_X86
+        case FORCE_KERNEL_AVX2:
+            return force_kernel_symmetric_avx2;
+        case FORCE_KERNEL_AVX512:
+            return force_kernel_symmetric_avx512;
+#endif
+        default:
+            return force_kernel_symmetric_scalar;
+    }
+}
+
+/* Tiled */
+
+/*
+    Sizes of the cache blocks: every target tile is run against one source
+    tile at a time, so the sources (12 bytes per body) stay in the L1 or
+    L2 cache while all targets of the tile pass over them, instead of being
+    streamed from memory once per target.
+*/
+typedef struct _force_kernel_tiling {
+    size_t target_tile;
+    size_t source_tile;
+} force_kernel_tiling_t;
+
+#define FORCE_KERNEL_DEFAULT_TARGET_TILE 256
+#define FORCE_KERNEL_DEFAULT_SOURCE_TILE 2048
+
+typedef void (*_force_kernel_block_function_t)(
+                 const float *target_x, const float *target_y,
+                 size_t begin, size_t end,
+                 const float *source_x, const float *source_y, const float *source_mass,
+                 size_t source_begin, size_t source_end,
+                 float softening_length_squared,
+                 float *ax, float *ay
+             );
+
+static void force_kernel_tiled(
+                force_kernel_t kernel,
+                const force_kernel_tiling_t *tiling,
+                const float *target_x, const float *target_y,
+                size_t begin, size_t end,
+                const bodies_soa_t *sources,
+                float softening_length_squared,
+                float *ax, float *ay
+            )
+{
+    _force_kernel_block_function_t block = _force_kernel_block_scalar;
+    size_t source_count = sources->count;
+    switch (kernel) {
+#ifdef FORCE_KERNELS_X86
+        case FORCE_KERNEL_AVX2:
+            block = _force_kernel_block_avx2;
+            source_count = sources->padded_count;
+            break;
+        case FORCE_KERNEL_AVX512:
+            block = _force_kernel_block_avx512;
+            source_count = sources->padded_count;
+            break;
+#endif
+        default:
+            break;
+    }
+
+    size_t target_tile = 0 == tiling->target_tile ? end - begin : tiling->target_tile;
+    size_t source_tile =
+        (tiling->source_tile + BODIES_SOA_PADDING - 1) / BODIES_SOA_PADDING * BODIES_SOA_PADDING;
+    if (0 == source_tile) {
+        source_tile = source_count;
+    }
+
+    for (size_t target_begin = begin; target_begin < end; target_begin += target_tile) {
+        size_t target_end = target_begin + target_tile < end ? target_begin + target_tile : end;
+
+        for (size_t source_begin = 0; source_begin < source_count; source_begin += source_tile) {
+            size_t source_end =
+                source_begin + source_tile < source_count ?
+                    source_begin + source_tile : source_count;
+
+            block(
+                target_x, target_y,
+                target_begin, target_end,
+                sources->x, sources->y, sources->mass,
+                source_begin, source_end,
+                softening_length_squared,
+                &ax[target_begin - begin], &ay[target_begin - begin]
+            );
+        }
+    }
+}
+
+/* Returns NULL for the reference kernel, which works on `body_t` instead. */
+static force_kernel_function_t force_kernel_get_function(force_kernel_t kernel)
+{
+    switch (kernel) {
+        case FORCE_KERNEL_SCALAR:
+            return force_kernel_scalar;
+#ifdef FORCE_KERNELS_X86
+        case FORCE_KERNEL_AVX2:
+            return force_kernel_avx2;
+        case FORCE_KERNEL_AVX512:
+            return force_kernel_avx512;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+#endif // FORCE_KERNELS_H
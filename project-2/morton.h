@@ -0,0 +1,124 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "thread_team.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+    2D Morton (Z-order) keys and a parallel LSD radix sort for them.
+
+    A key interleaves 16 bits of the quantized x and y coordinates, so
+    bodies that are close in space tend to be close in the sorted order,
+    and every two bits of a common key prefix select one quadtree level.
+*/
+
+#define MORTON_BITS_PER_AXIS 16
+#define MORTON_KEY_BITS (2 * MORTON_BITS_PER_AXIS)
+#define MORTON_RADIX_BITS 8
+#define MORTON_RADIX (1 << MORTON_RADIX_BITS)
+
+static inline uint32_t morton_spread_bits(uint32_t value)
+{
+    value &= 0x0000FFFFu;
+    value = (value | (value << 8)) & 0x00FF00FFu;
+    value = (value | (value << 4)) & 0x0F0F0F0Fu;
+    value = (value | (value << 2)) & 0x33333333u;
+    value = (value | (value << 1)) & 0x55555555u;
+
+    return value;
+}
+
+static inline uint32_t morton_encode(uint32_t x, uint32_t y)
+{
+    return morton_spread_bits(x) | (morton_spread_bits(y) << 1);
+}
+
+/* Maps a coordinate in [min, min + size) to a cell index on one axis. */
+static inline uint32_t morton_quantize(float value, float min, float size)
+{
+    static const float Cells = (float) (1u << MORTON_BITS_PER_AXIS);
+
+    float cell = (value - min) / size * Cells;
+    if (cell <= 0.0f) {
+        return 0;
+    }
+    if (cell >= Cells - 1.0f) {
+        return (1u << MORTON_BITS_PER_AXIS) - 1;
+    }
+
+    return (uint32_t) cell;
+}
+
+/*
+    Sorts `keys` and the matching `values` in place. Must be called by all
+    members of the team at once. Each pass builds per-thread digit
+    histograms, turns them into per-thread output offsets, and then every
+    thread scatters its own range, so the sort is stable.
+
+    `histograms` must hold MORTON_RADIX * thread_count entries, and the
+    temporary arrays must hold `count` elements.
+*/
+static void morton_sort(
+                uint32_t *keys,
+                int32_t *values,
+                uint32_t *temporary_keys,
+                int32_t *temporary_values,
+                size_t count,
+                size_t *histograms,
+                thread_team_t *team,
+                size_t thread_index,
+                size_t thread_count
+            )
+{
+    size_t begin, end;
+    thread_team_split(count, thread_index, thread_count, &begin, &end);
+
+    size_t *histogram = &histograms[thread_index * MORTON_RADIX];
+
+    for (unsigned int shift = 0; shift < MORTON_KEY_BITS; shift += MORTON_RADIX_BITS) {
+        memset(histogram, 0, sizeof(*histogram) * MORTON_RADIX);
+        for (size_t i = begin; i < end; ++i) {
+            histogram[(keys[i] >> shift) & (MORTON_RADIX - 1)] += 1;
+        }
+
+        thread_team_barrier(team);
+
+        if (0 == thread_index) {
+            /* Digit-major, thread-minor order keeps equal digits stable. */
+            size_t offset = 0;
+            for (size_t digit = 0; digit < MORTON_RADIX; ++digit) {
+                for (size_t thread = 0; thread < thread_count; ++thread) {
+                    size_t *bucket = &histograms[thread * MORTON_RADIX + digit];
+
+                    size_t bucket_count = *bucket;
+                    *bucket = offset;
+                    offset += bucket_count;
+                }
+            }
+        }
+
+        thread_team_barrier(team);
+
+        for (size_t i = begin; i < end; ++i) {
+            size_t position = histogram[(keys[i] >> shift) & (MORTON_RADIX - 1)]++;
+            temporary_keys[position] = keys[i];
+            temporary_values[position] = values[i];
+        }
+
+        thread_team_barrier(team);
+
+        /* The number of passes is even, so the result ends up in `keys`. */
+        uint32_t *swapped_keys = keys;
+        keys = temporary_keys;
+        temporary_keys = swapped_keys;
+
+        int32_t *swapped_values = values;
+        values = temporary_values;
+        temporary_values = swapped_values;
+    }
+}
+
+#endif // MORTON_H
@@ -5,30 +5,126 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <unistd.h>
 #include <mpi.h>
+
+#include "body.h"
+#include "barnes_hut.h"
+#include "force_kernels.h"
+#include "thread_team.h"
+#include "output_writer.h"
+#include "trajectory.h"
+
 /* Constants */
 
 #define Default_Debug_Acceleration_Scale 100.0f
+#define Default_Barnes_Hut_Theta 0.5f
+#define Default_Block_Accuracy 0.025f
+#define Max_Block_Levels 16
+#define Output_Buffer_Size (1 << 22)
+#define Output_Step_Buffers 4
+#define Parallel_Output_Buffer_Size "16777216"
+
 /* Types */
 
-typedef struct _body {
-    float x, y;
-    float ax, ay;
-    float vx, vy;
-    float mass;
-} body_t;
+typedef enum _solver {
+    SOLVER_BRUTEFORCE,
+    SOLVER_BARNES_HUT,
+    SOLVER_COUNT
+} solver_t;
+
+static const char *Solver_Names[] = {
+    "bruteforce",
+    "barnes-hut"
+};
+
+typedef enum _tree_builder {
+    TREE_BUILDER_INSERTION,
+    TREE_BUILDER_MORTON,
+    TREE_BUILDER_COUNT
+} tree_builder_t;
+
+static const char *Tree_Builder_Names[] = {
+    "insertion",
+    "morton"
+};
+
+typedef enum _integrator {
+    INTEGRATOR_EULER,
+    INTEGRATOR_LEAPFROG,
+    INTEGRATOR_VERLET,
+    INTEGRATOR_COUNT
+} integrator_t;
+
+static const char *Integrator_Names[] = {
+    "euler",
+    "leapfrog",
+    "verlet"
+};
 
 /* Globals */
 
 static float debug_acceleration_scale =
     Default_Debug_Acceleration_Scale;
 
+static solver_t simulation_solver = SOLVER_BRUTEFORCE;
+static float barnes_hut_theta = Default_Barnes_Hut_Theta;
+static tree_builder_t barnes_hut_tree_builder = TREE_BUILDER_MORTON;
+static quadtree_t quadtree;
+
+static force_kernel_t force_kernel = FORCE_KERNEL_AUTO;
+static force_kernel_function_t force_kernel_function = NULL;
+static bodies_soa_t bodies_soa;
+static float *slice_ax = NULL, *slice_ay = NULL;
+
+static bool should_report_performance = false;
+static bool should_report_energy = false;
+static integrator_t simulation_integrator = INTEGRATOR_EULER;
+static output_format_t output_format = OUTPUT_FORMAT_TEXT;
+
+static bool is_tiled = false;
+static force_kernel_tiling_t force_kernel_tiling = {
+    FORCE_KERNEL_DEFAULT_TARGET_TILE,
+    FORCE_KERNEL_DEFAULT_SOURCE_TILE
+};
+
+static bool is_ring = false;
+static bodies_soa_t ring_blocks[3];
+
+static bool is_symmetric = false;
+static float *symmetric_ax = NULL, *symmetric_ay = NULL;
+static size_t symmetric_capacity = 0;
+
+static int *slice_counts = NULL, *slice_offsets = NULL;
+static double *slice_weights = NULL;
+static size_t slice_capacity = 0;
+static size_t balance_interval = 0;
+
+static size_t thread_count = 1;
+static thread_team_t *thread_team = NULL;
+
+static unsigned int block_max_level = 0;
+static float block_accuracy = Default_Block_Accuracy;
+static uint8_t *slice_levels = NULL, *body_levels = NULL;
+static size_t *active_indices = NULL;
+static float *active_x = NULL, *active_y = NULL;
+static float *active_ax = NULL, *active_ay = NULL;
+static size_t block_capacity = 0;
+static uint64_t block_force_evaluations = 0;
+
 static body_t* bodies = NULL;
 static body_t* local_bodies = NULL;
 static float initial_body_mass;
 
 static float simulation_softening_length_squared;
-static float* accelerations = NULL;
+static output_writer_t *output_writer = NULL;
+static size_t output_thread_count = 1;
+
+static const char *parallel_output_path = NULL;
+static MPI_File parallel_output_file = MPI_FILE_NULL;
+static trajectory_header_t parallel_output_header;
+static float *parallel_output_buffer = NULL;
+static size_t parallel_output_capacity = 0;
 
 /* Utilities */
 
@@ -106,6 +202,30 @@ static MPI_Datatype create_body_t()
     return type;
 }
 
+/*
+    Two adjacent fields of a body, such as the position or the
+    acceleration, with the extent of the whole body. Arrays of `body_t`
+    can then be exchanged in place while only these fields go over the
+    wire, and the other fields of the receiver stay as they are.
+*/
+static MPI_Datatype create_body_pair_t(MPI_Aint offset)
+{
+    static const int count = 1;
+    const int block_lengths[] = { 2 };
+    MPI_Aint offsets[] = { offset };
+    const MPI_Datatype types[] = { MPI_FLOAT };
+
+    MPI_Datatype pair_type;
+    MPI_Type_create_struct(count, block_lengths, offsets, types, &pair_type);
+
+    MPI_Datatype type;
+    MPI_Type_create_resized(pair_type, 0, sizeof(body_t), &type);
+    MPI_Type_commit(&type);
+    MPI_Type_free(&pair_type);
+
+    return type;
+}
+
 
 /* Simulation */
 
@@ -130,33 +250,720 @@ static void generate_debug_data(body_t *bodies, size_t body_count)
     }
 }
 
-static void calculate_newton_gravity_acceleration(
-                body_t *first_body, body_t *second_body,
+/* Decomposition */
+
+/*
+    Splits the bodies between the processes in proportion to the weights,
+    or evenly for NULL weights. Counts and offsets are in bodies, in the
+    form that `MPI_Allgatherv` and friends take.
+*/
+static void partition_bodies(
+                size_t body_count,
+                const double *weights,
+                int w_size,
+                int *counts,
+                int *offsets
+            )
+{
+    double total_weight = 0.0;
+    if (NULL != weights) {
+        for (int i = 0; i < w_size; ++i) {
+            total_weight += weights[i];
+        }
+    }
+
+    if (total_weight <= 0.0) {
+        for (int i = 0; i < w_size; ++i) {
+            size_t begin, end;
+            thread_team_split(body_count, (size_t) i, (size_t) w_size, &begin, &end);
+            offsets[i] = (int) begin;
+            counts[i] = (int) (end - begin);
+        }
+        return;
+    }
+
+    /* Rounding the prefix sums keeps the slices contiguous and complete. */
+    double prefix_weight = 0.0;
+    size_t begin = 0;
+    for (int i = 0; i < w_size; ++i) {
+        prefix_weight += weights[i];
+
+        size_t end = i + 1 == w_size ?
+            body_count : (size_t) llround((double) body_count * prefix_weight / total_weight);
+        if (end < begin) {
+            end = begin;
+        }
+        if (end > body_count) {
+            end = body_count;
+        }
+
+        offsets[i] = (int) begin;
+        counts[i] = (int) (end - begin);
+        begin = end;
+    }
+}
+
+/*
+    Repartitions the bodies by the rate at which every process computed its
+    slice since the last call. A process that is twice as fast gets twice
+    as many bodies, so processes on mixed hardware finish a step together.
+*/
+static void rebalance_slices(size_t body_count, double compute_time, int w_size)
+{
+    MPI_Allgather(&compute_time, 1, MPI_DOUBLE, slice_weights, 1, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    double total_rate = 0.0;
+    int measured_count = 0;
+    for (int i = 0; i < w_size; ++i) {
+        if (0 < slice_counts[i] && 0.0 < slice_weights[i]) {
+            slice_weights[i] = (double) slice_counts[i] / slice_weights[i];
+            total_rate += slice_weights[i];
+            ++measured_count;
+        } else {
+            slice_weights[i] = -1.0;
+        }
+    }
+
+    if (0 == measured_count) {
+        return;
+    }
+
+    /* Processes without a measurement get the average rate. */
+    double average_rate = total_rate / measured_count;
+    for (int i = 0; i < w_size; ++i) {
+        if (slice_weights[i] < 0.0) {
+            slice_weights[i] = average_rate;
+        }
+    }
+
+    partition_bodies(body_count, slice_weights, w_size, slice_counts, slice_offsets);
+}
+
+/* Makes room for a slice of `count` bodies in the local buffers. */
+static bool reserve_slice_buffers(size_t count)
+{
+    if (count <= slice_capacity && NULL != local_bodies) {
+        return true;
+    }
+
+    free(local_bodies);
+    free(slice_ax);
+    free(slice_ay);
+
+    size_t capacity = 0 == count ? 1 : count;
+    local_bodies = (body_t *) malloc(sizeof(*local_bodies) * capacity);
+    slice_ax = (float *) malloc(sizeof(*slice_ax) * capacity);
+    slice_ay = (float *) malloc(sizeof(*slice_ay) * capacity);
+    slice_capacity = NULL == local_bodies || NULL == slice_ax || NULL == slice_ay ? 0 : capacity;
+
+    return 0 != slice_capacity;
+}
+
+/* Symmetric */
+
+typedef struct _symmetric_task {
+    size_t first_part;
+    size_t part_count;
+    force_kernel_symmetric_function_t function;
+} symmetric_task_t;
+
+/*
+    Every thread of every process takes an equal share of the pairs and
+    accumulates into its own buffer for all bodies. The buffers of the
+    threads are then summed into the first one, column by column.
+*/
+static void calculate_symmetric_accelerations_task(void *data, size_t thread_index, size_t thread_count)
+{
+    symmetric_task_t *task = (symmetric_task_t *) data;
+
+    size_t stride = bodies_soa.padded_count;
+    float *ax = &symmetric_ax[thread_index * stride];
+    float *ay = &symmetric_ay[thread_index * stride];
+    memset(ax, 0, sizeof(*ax) * stride);
+    memset(ay, 0, sizeof(*ay) * stride);
+
+    size_t row_begin, row_end;
+    force_kernel_split_pairs(
+        bodies_soa.count,
+        task->first_part + thread_index, task->part_count,
+        &row_begin, &row_end
+    );
+    task->function(
+        &bodies_soa,
+        row_begin, row_end,
+        simulation_softening_length_squared,
+        ax, ay
+    );
+
+    thread_team_barrier(thread_team);
+
+    size_t begin, end;
+    thread_team_split(bodies_soa.count, thread_index, thread_count, &begin, &end);
+    for (size_t thread = 1; thread < thread_count; ++thread) {
+        const float *thread_ax = &symmetric_ax[thread * stride];
+        const float *thread_ay = &symmetric_ay[thread * stride];
+        for (size_t i = begin; i < end; ++i) {
+            symmetric_ax[i] += thread_ax[i];
+            symmetric_ay[i] += thread_ay[i];
+        }
+    }
+}
+
+static bool reserve_symmetric_buffers(void)
+{
+    size_t capacity = thread_team_get_thread_count(thread_team) * bodies_soa.padded_count;
+    if (capacity <= symmetric_capacity) {
+        return true;
+    }
+
+    free(symmetric_ax);
+    free(symmetric_ay);
+    symmetric_ax = bodies_soa_allocate_array(capacity);
+    symmetric_ay = bodies_soa_allocate_array(capacity);
+    symmetric_capacity = NULL == symmetric_ax || NULL == symmetric_ay ? 0 : capacity;
+
+    return 0 != symmetric_capacity;
+}
+
+/*
+    Evaluates every pair once over all processes and threads, and sums the
+    partial accelerations of all processes into the slices that own them.
+*/
+static void calculate_symmetric_accelerations(float *ax, float *ay)
+{
+    int w_size, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &w_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    size_t thread_count = thread_team_get_thread_count(thread_team);
+    symmetric_task_t task = {
+        .first_part = (size_t) rank * thread_count,
+        .part_count = (size_t) w_size * thread_count,
+        .function = force_kernel_get_symmetric_function(force_kernel)
+    };
+    thread_team_run(thread_team, calculate_symmetric_accelerations_task, &task);
+
+    MPI_Reduce_scatter(symmetric_ax, ax, slice_counts, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Reduce_scatter(symmetric_ay, ay, slice_counts, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+}
+
+/* Computes the accelerations of the bodies [begin, end) into ax and ay on the calling thread. */
+static void calculate_range_accelerations(
+                body_t *bodies, size_t body_count,
+                size_t begin, size_t end,
                 float *ax, float *ay
             )
 {
-    *ax = *ay = 0.0f;
+    memset(ax, 0, sizeof(*ax) * (end - begin));
+    memset(ay, 0, sizeof(*ay) * (end - begin));
+
+    switch (simulation_solver) {
+        case SOLVER_BARNES_HUT:
+            for (size_t i = begin; i < end; ++i) {
+                quadtree_calculate_acceleration(
+                    &quadtree,
+                    i,
+                    bodies[i].x, bodies[i].y,
+                    barnes_hut_theta,
+                    simulation_softening_length_squared,
+                    &ax[i - begin], &ay[i - begin]
+                );
+            }
+            break;
+        default:
+            if (is_tiled) {
+                force_kernel_tiled(
+                    force_kernel,
+                    &force_kernel_tiling,
+                    bodies_soa.x, bodies_soa.y,
+                    begin, end,
+                    &bodies_soa,
+                    simulation_softening_length_squared,
+                    ax, ay
+                );
+            } else if (NULL == force_kernel_function) {
+                force_kernel_reference(
+                    bodies, body_count,
+                    begin, end,
+                    simulation_softening_length_squared,
+                    ax, ay
+                );
+            } else {
+                force_kernel_function(
+                    bodies_soa.x, bodies_soa.y,
+                    begin, end,
+                    &bodies_soa,
+                    simulation_softening_length_squared,
+                    ax, ay
+                );
+            }
+            break;
+    }
+}
+
+/* Hybrid */
+
+typedef struct _slice_task {
+    body_t *bodies;
+    size_t body_count;
+    size_t begin, end;
+    float *ax, *ay;
+} slice_task_t;
+
+static void calculate_slice_accelerations_task(void *data, size_t thread_index, size_t thread_count)
+{
+    slice_task_t *task = (slice_task_t *) data;
 
-    float galactic_plane_r_x =
-        second_body->x - first_body->x;
-    float galactic_plane_r_y =
-        second_body->y - first_body->y;
+    size_t begin, end;
+    thread_team_split(task->end - task->begin, thread_index, thread_count, &begin, &end);
 
-    float distance_squared =
-        (galactic_plane_r_x * galactic_plane_r_x  +
-         galactic_plane_r_y * galactic_plane_r_y) +
-            simulation_softening_length_squared;
-    float distance_squared_cubed =
-        distance_squared * distance_squared * distance_squared;
-    float inverse =
-        1.0f / sqrtf(distance_squared_cubed);
-    float scale =
-        second_body->mass * inverse;
+    calculate_range_accelerations(
+        task->bodies, task->body_count,
+        task->begin + begin, task->begin + end,
+        &task->ax[begin], &task->ay[begin]
+    );
+}
+
+/*
+    Computes the accelerations of the slice [begin, end) of this process
+    into ax and ay. The slice is split between the threads of the team,
+    which share the body arrays and the solver structures of the process.
+*/
+static void calculate_slice_accelerations(
+                body_t *bodies, size_t body_count,
+                size_t begin, size_t end,
+                float *ax, float *ay
+            )
+{
+    if (is_symmetric) {
+        calculate_symmetric_accelerations(ax, ay);
+        return;
+    }
 
-    *ax += galactic_plane_r_x * scale;
-    *ay += galactic_plane_r_y * scale;
+    slice_task_t task = {
+        .bodies = bodies,
+        .body_count = body_count,
+        .begin = begin,
+        .end = end,
+        .ax = ax,
+        .ay = ay
+    };
+    thread_team_run(thread_team, calculate_slice_accelerations_task, &task);
 }
 
+/* Ring */
+
+#define Ring_Progress_Chunks 8
+
+typedef struct _ring_task {
+    const bodies_soa_t *targets;
+    const bodies_soa_t *sources;
+    size_t begin, end;
+    float *ax, *ay;
+} ring_task_t;
+
+static void calculate_ring_block_task(void *data, size_t thread_index, size_t thread_count)
+{
+    ring_task_t *task = (ring_task_t *) data;
+
+    size_t begin, end;
+    thread_team_split(task->end - task->begin, thread_index, thread_count, &begin, &end);
+    begin += task->begin;
+    end += task->begin;
+
+    if (is_tiled) {
+        force_kernel_tiled(
+            force_kernel,
+            &force_kernel_tiling,
+            task->targets->x, task->targets->y,
+            begin, end,
+            task->sources,
+            simulation_softening_length_squared,
+            &task->ax[begin], &task->ay[begin]
+        );
+    } else {
+        force_kernel_function_t function =
+            NULL == force_kernel_function ? force_kernel_scalar : force_kernel_function;
+        function(
+            task->targets->x, task->targets->y,
+            begin, end,
+            task->sources,
+            simulation_softening_length_squared,
+            &task->ax[begin], &task->ay[begin]
+        );
+    }
+}
+
+/*
+    Systolic ring: every process keeps only its own bodies, and blocks of
+    positions and masses travel around the ring of processes. While the
+    forces of one block are computed, the next one is already being sent
+    to the right neighbour and received from the left one, so after P - 1
+    shifts every process has seen every block with memory for three blocks.
+
+    The computation is split into chunks with an MPI_Testall between them,
+    which lets MPI libraries without a progress thread move the messages.
+    The time spent computing, without waiting, is added to `compute_time`.
+*/
+static bool calculate_ring_accelerations(
+                const body_t *bodies, size_t body_count,
+                float *ax, float *ay,
+                double *compute_time
+            )
+{
+    int w_size, rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &w_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    int left = (rank + w_size - 1) % w_size;
+    int right = (rank + 1) % w_size;
+
+    bodies_soa_t *targets = &ring_blocks[0];
+    if (NULL == bodies_soa_load(targets, bodies, body_count)) {
+        return false;
+    }
+
+    memset(ax, 0, sizeof(*ax) * body_count);
+    memset(ay, 0, sizeof(*ay) * body_count);
+
+    bodies_soa_t *current = targets;
+    for (int shift = 0; shift < w_size; ++shift) {
+        MPI_Request requests[2];
+        int request_count = 0;
+
+        bodies_soa_t *next = &ring_blocks[1 + shift % 2];
+        if (shift + 1 < w_size) {
+            int sender = (rank + 2 * w_size - shift - 1) % w_size;
+            if (NULL == bodies_soa_resize(next, (size_t) slice_counts[sender])) {
+                return false;
+            }
+
+            int next_size = (int) (BODIES_SOA_FIELDS * next->padded_count);
+            int current_size = (int) (BODIES_SOA_FIELDS * current->padded_count);
+            MPI_Irecv(next->x, next_size, MPI_FLOAT, left, shift, MPI_COMM_WORLD, &requests[request_count++]);
+            MPI_Isend(current->x, current_size, MPI_FLOAT, right, shift, MPI_COMM_WORLD, &requests[request_count++]);
+        }
+
+        double compute_start_time = MPI_Wtime();
+        for (size_t chunk = 0; chunk < Ring_Progress_Chunks; ++chunk) {
+            ring_task_t task = {
+                .targets = targets,
+                .sources = current,
+                .begin = body_count * chunk / Ring_Progress_Chunks,
+                .end = body_count * (chunk + 1) / Ring_Progress_Chunks,
+                .ax = ax,
+                .ay = ay
+            };
+            thread_team_run(thread_team, calculate_ring_block_task, &task);
+
+            if (0 < request_count) {
+                int is_complete;
+                MPI_Testall(request_count, requests, &is_complete, MPI_STATUSES_IGNORE);
+            }
+        }
+        *compute_time += MPI_Wtime() - compute_start_time;
+
+        if (0 < request_count) {
+            MPI_Waitall(request_count, requests, MPI_STATUSES_IGNORE);
+        }
+
+        current = next;
+    }
+
+    return true;
+}
+
+/* Parallel Output */
+
+/*
+    Opens the binary trajectory for all processes with MPI-IO, sized for
+    the whole run. Only the root writes the header and the initial bodies,
+    with chunks that are independent writes. Collective buffering lets a
+    few aggregators turn the small slices of all processes into large
+    contiguous writes.
+*/
+static bool open_parallel_output(const trajectory_header_t *header, const body_t *bodies, int rank)
+{
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "romio_cb_write", "enable");
+    MPI_Info_set(info, "cb_buffer_size", Parallel_Output_Buffer_Size);
+    MPI_Info_set(info, "striping_unit", Parallel_Output_Buffer_Size);
+
+    int result = MPI_File_open(
+        MPI_COMM_WORLD,
+        parallel_output_path,
+        MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        info,
+        &parallel_output_file
+    );
+    MPI_Info_free(&info);
+
+    if (MPI_SUCCESS != result) {
+        parallel_output_file = MPI_FILE_NULL;
+        return false;
+    }
+
+    parallel_output_header = *header;
+    bool is_written =
+        MPI_SUCCESS == MPI_File_set_size(parallel_output_file, (MPI_Offset) trajectory_get_size(header));
+
+    if (0 == rank && is_written) {
+        uint8_t header_bytes[TRAJECTORY_HEADER_SIZE];
+        trajectory_encode_header(header_bytes, header);
+        is_written = MPI_SUCCESS == MPI_File_write_at(
+            parallel_output_file, 0, header_bytes, TRAJECTORY_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE
+        );
+
+        static const size_t Chunk_Body_Count = Trajectory_Chunk_Size / TRAJECTORY_BODY_FIELDS;
+        float values[Trajectory_Chunk_Size];
+        for (size_t begin = 0; is_written && begin < header->body_count; begin += Chunk_Body_Count) {
+            size_t chunk = header->body_count - begin < Chunk_Body_Count ? header->body_count - begin : Chunk_Body_Count;
+            trajectory_pack_bodies(values, &bodies[begin], chunk);
+            trajectory_encode_floats(values, chunk * TRAJECTORY_BODY_FIELDS);
+
+            MPI_Offset offset = TRAJECTORY_HEADER_SIZE + begin * TRAJECTORY_BODY_FIELDS * sizeof(float);
+            is_written = MPI_SUCCESS == MPI_File_write_at(
+                parallel_output_file, offset, values, (int) (chunk * TRAJECTORY_BODY_FIELDS), MPI_FLOAT, MPI_STATUS_IGNORE
+            );
+        }
+    }
+
+    int is_written_everywhere = is_written;
+    MPI_Allreduce(MPI_IN_PLACE, &is_written_everywhere, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+
+    return is_written_everywhere;
+}
+
+/* Every process writes the accelerations of its own slice at their place in the file. */
+static bool write_parallel_output_step(
+                size_t step,
+                const body_t *bodies, size_t body_count,
+                size_t slice_start
+            )
+{
+    if (2 * body_count > parallel_output_capacity) {
+        free(parallel_output_buffer);
+        parallel_output_buffer = (float *) malloc(sizeof(*parallel_output_buffer) * 2 * body_count);
+        parallel_output_capacity = NULL == parallel_output_buffer ? 0 : 2 * body_count;
+    }
+
+    /* Every process has to take part in the collective write, even without a buffer. */
+    size_t count = NULL == parallel_output_buffer ? 0 : body_count;
+    for (size_t i = 0; i < count; ++i) {
+        parallel_output_buffer[2 * i] = bodies[i].ax;
+        parallel_output_buffer[2 * i + 1] = bodies[i].ay;
+    }
+    trajectory_encode_floats(parallel_output_buffer, 2 * count);
+
+    MPI_Offset offset = (MPI_Offset) trajectory_get_acceleration_offset(&parallel_output_header, step, slice_start);
+    int result = MPI_File_write_at_all(
+        parallel_output_file, offset, parallel_output_buffer, (int) (2 * count), MPI_FLOAT, MPI_STATUS_IGNORE
+    );
+
+    return MPI_SUCCESS == result && count == body_count;
+}
+
+static bool close_parallel_output(void)
+{
+    if (MPI_FILE_NULL == parallel_output_file) {
+        return true;
+    }
+
+    bool is_closed = MPI_SUCCESS == MPI_File_close(&parallel_output_file);
+
+    free(parallel_output_buffer);
+    parallel_output_buffer = NULL;
+    parallel_output_capacity = 0;
+
+    return is_closed;
+}
+
+/*
+    Splits the cores of a node between the processes that run on it, for
+    one process per node or socket with a thread per core.
+*/
+static size_t get_default_thread_count(void)
+{
+    MPI_Comm node_communicator;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_communicator);
+
+    int node_size = 1;
+    MPI_Comm_size(node_communicator, &node_size);
+    MPI_Comm_free(&node_communicator);
+
+    long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (core_count < 1) {
+        core_count = 1;
+    }
+
+    size_t thread_count = (size_t) core_count / (size_t) node_size;
+
+    return 0 == thread_count ? 1 : thread_count;
+}
+
+/* Rebuilds the acceleration structures of the solver for the current positions. */
+static bool prepare_solver(body_t *bodies, size_t body_count)
+{
+    switch (simulation_solver) {
+        case SOLVER_BARNES_HUT:
+            if (TREE_BUILDER_MORTON == barnes_hut_tree_builder) {
+                return NULL != quadtree_build_morton(&quadtree, bodies, body_count, thread_team);
+            }
+            return NULL != quadtree_build(&quadtree, bodies, body_count);
+        default:
+            if (is_symmetric) {
+                return NULL != bodies_soa_load(&bodies_soa, bodies, body_count) &&
+                           reserve_symmetric_buffers();
+            }
+            if (is_tiled || NULL != force_kernel_function || 0 < block_max_level) {
+                return NULL != bodies_soa_load(&bodies_soa, bodies, body_count);
+            }
+            return true;
+    }
+}
+
+/*
+    Prints the time spent on forces by the slowest process and the rate of
+    pairwise interactions to stderr. For approximate solvers, the rate is
+    the one that the all-pairs method would need for the same time.
+*/
+static void report_performance(size_t body_count, size_t iterations, double force_time, int rank)
+{
+    double slowest_force_time = 0.0;
+    MPI_Reduce(&force_time, &slowest_force_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (0 != rank) {
+        return;
+    }
+
+    double interactions = (double) body_count * (double) (body_count - 1) * (double) iterations;
+    fprintf(
+        stderr,
+        "solver: %s%s%s, kernel: %s, force time: %.3f s, interactions: %.0f, interactions/s: %.3e\n",
+        Solver_Names[simulation_solver],
+        is_symmetric ? " (symmetric)" : "",
+        is_tiled ? " (tiled)" : "",
+        Force_Kernel_Names[force_kernel],
+        slowest_force_time,
+        interactions,
+        slowest_force_time > 0.0 ? interactions / slowest_force_time : 0.0
+    );
+
+    if (0 < balance_interval) {
+        int w_size;
+        MPI_Comm_size(MPI_COMM_WORLD, &w_size);
+
+        fprintf(stderr, "slices:");
+        for (int i = 0; i < w_size; ++i) {
+            fprintf(stderr, " %d", slice_counts[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+/* Energy */
+
+typedef struct _energy_task {
+    const body_t *bodies;
+    size_t body_count;
+    size_t begin, end;
+    double *potentials;
+} energy_task_t;
+
+static void calculate_potential_energy_task(void *data, size_t thread_index, size_t thread_count)
+{
+    energy_task_t *task = (energy_task_t *) data;
+
+    size_t begin, end;
+    thread_team_split(task->end - task->begin, thread_index, thread_count, &begin, &end);
+    begin += task->begin;
+    end += task->begin;
+
+    double softening_length_squared = simulation_softening_length_squared;
+    double potential = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+        const body_t *first_body = &task->bodies[i];
+        for (size_t j = 0; j < task->body_count; ++j) {
+            const body_t *second_body = &task->bodies[j];
+            if (first_body == second_body) {
+                continue;
+            }
+
+            double r_x = (double) second_body->x - first_body->x;
+            double r_y = (double) second_body->y - first_body->y;
+            potential -=
+                (double) first_body->mass * second_body->mass /
+                    sqrt(r_x * r_x + r_y * r_y + softening_length_squared);
+        }
+    }
+
+    /* Every pair is visited from both sides. */
+    task->potentials[thread_index] = 0.5 * potential;
+}
+
+/*
+    Returns the total energy of the system on the root, with the softened
+    potential that matches the forces (G = 1). Every process adds the
+    kinetic energy of its own slice and the potential energy of the rows
+    [begin, end) of `bodies`, which must hold the current positions.
+*/
+static double calculate_total_energy(
+                  const body_t *bodies, size_t body_count,
+                  size_t begin, size_t end,
+                  const body_t *local_bodies, size_t local_count
+              )
+{
+    double energy = 0.0;
+    for (size_t i = 0; i < local_count; ++i) {
+        const body_t *body = &local_bodies[i];
+        energy += 0.5 * body->mass * ((double) body->vx * body->vx + (double) body->vy * body->vy);
+    }
+
+    size_t thread_count = thread_team_get_thread_count(thread_team);
+    double *potentials = (double *) calloc(thread_count, sizeof(*potentials));
+    assert(potentials != NULL);
+
+    energy_task_t task = {
+        .bodies = bodies,
+        .body_count = body_count,
+        .begin = begin,
+        .end = end,
+        .potentials = potentials
+    };
+    thread_team_run(thread_team, calculate_potential_energy_task, &task);
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        energy += potentials[i];
+    }
+    free(potentials);
+
+    double total_energy = 0.0;
+    MPI_Reduce(&energy, &total_energy, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    return total_energy;
+}
+
+static void report_energy(double initial_energy, double final_energy, int rank)
+{
+    if (0 != rank) {
+        return;
+    }
+
+    double drift = 0.0 != initial_energy ? (final_energy - initial_energy) / fabs(initial_energy) : 0.0;
+    fprintf(
+        stderr,
+        "integrator: %s, initial energy: %.9e, final energy: %.9e, relative drift: %.3e\n",
+        Integrator_Names[simulation_integrator],
+        initial_energy,
+        final_energy,
+        drift
+    );
+}
+
+/* Integrators */
+
+/* Symplectic Euler: a full kick with the new accelerations, then a drift. */
 static void integrate(body_t *body, float delta_time)
 {
     body->vx += body->ax * delta_time;
@@ -165,23 +972,470 @@ static void integrate(body_t *body, float delta_time)
     body->y  += body->vy * delta_time;
 }
 
+/*
+    Completes the previous step with the accelerations at the current
+    positions, so that positions and velocities refer to the same time,
+    and stores the accelerations in the body. Leapfrog (kick-drift-kick)
+    gives the second half of its kick here, velocity Verlet the average of
+    the old and the new accelerations, and symplectic Euler nothing.
+
+    A zero `delta_time` starts the first step.
+*/
+static void integrate_close_step(body_t *body, float ax, float ay, float delta_time)
+{
+    switch (simulation_integrator) {
+        case INTEGRATOR_LEAPFROG:
+            body->vx += ax * 0.5f * delta_time;
+            body->vy += ay * 0.5f * delta_time;
+            break;
+        case INTEGRATOR_VERLET:
+            body->vx += (body->ax + ax) * 0.5f * delta_time;
+            body->vy += (body->ay + ay) * 0.5f * delta_time;
+            break;
+        default:
+            break;
+    }
+
+    body->ax = ax;
+    body->ay = ay;
+}
+
+/* Moves the body to the positions of the next step, where the forces are evaluated once. */
+static void integrate_open_step(body_t *body, float delta_time)
+{
+    switch (simulation_integrator) {
+        case INTEGRATOR_LEAPFROG:
+            body->vx += body->ax * 0.5f * delta_time;
+            body->vy += body->ay * 0.5f * delta_time;
+            body->x  += body->vx * delta_time;
+            body->y  += body->vy * delta_time;
+            break;
+        case INTEGRATOR_VERLET:
+            body->x  += (body->vx + body->ax * 0.5f * delta_time) * delta_time;
+            body->y  += (body->vy + body->ay * 0.5f * delta_time) * delta_time;
+            break;
+        default:
+            integrate(body, delta_time);
+            break;
+    }
+}
+
+/* Block Time Steps */
+
+/*
+    Hierarchical (power of two) time steps for leapfrog. A body on level L
+    takes steps of delta_time / 2^L, and level `block_max_level` is the
+    sub-step of the whole hierarchy. Within one step of the simulation,
+    all bodies drift at every sub-step, which predicts the positions of
+    the ones that do not move on their own level, and only the bodies
+    whose step ends at a sub-step get their forces evaluated and kicked.
+    At the end of every simulation step, all levels are in sync again.
+
+    The step of a body is dt = sqrt(2 * accuracy * softening length / |a|).
+*/
+
+static unsigned int select_block_level(float ax, float ay, float delta_time, float softening_length)
+{
+    float acceleration = sqrtf(ax * ax + ay * ay);
+    if (acceleration <= 0.0f) {
+        return 0;
+    }
+
+    float step = sqrtf(2.0f * block_accuracy * softening_length / acceleration);
+
+    unsigned int level = 0;
+    while (level < block_max_level && step < ldexpf(delta_time, -(int) level)) {
+        ++level;
+    }
+
+    return level;
+}
+
+/* Makes the level fine enough for its steps to start at `substep`. */
+static inline unsigned int align_block_level(unsigned int level, size_t substep)
+{
+    while (level < block_max_level && 0 != substep % ((size_t) 1 << (block_max_level - level))) {
+        ++level;
+    }
+
+    return level;
+}
+
+/* The step of the body `i` of the slice, the global step without block time steps. */
+static inline float get_block_delta_time(size_t i, float delta_time)
+{
+    return 0 < block_max_level ? ldexpf(delta_time, -(int) slice_levels[i]) : delta_time;
+}
+
+static bool reserve_block_buffers(size_t count)
+{
+    if (count <= block_capacity && NULL != slice_levels) {
+        return true;
+    }
+
+    free(slice_levels);
+    free(active_indices);
+    free(active_x);
+    free(active_y);
+    free(active_ax);
+    free(active_ay);
+
+    size_t capacity = 0 == count ? 1 : count;
+    slice_levels = (uint8_t *) calloc(capacity, sizeof(*slice_levels));
+    active_indices = (size_t *) malloc(sizeof(*active_indices) * capacity);
+    active_x = (float *) malloc(sizeof(*active_x) * capacity);
+    active_y = (float *) malloc(sizeof(*active_y) * capacity);
+    active_ax = (float *) malloc(sizeof(*active_ax) * capacity);
+    active_ay = (float *) malloc(sizeof(*active_ay) * capacity);
+    block_capacity =
+        NULL == slice_levels || NULL == active_indices ||
+        NULL == active_x || NULL == active_y ||
+        NULL == active_ax || NULL == active_ay ? 0 : capacity;
+
+    return 0 != block_capacity;
+}
+
+/* Selects the next level of a body at the start of its step and gives the opening half kick. */
+static void open_block_step(body_t *body, uint8_t *level, size_t substep, float delta_time, float softening_length)
+{
+    unsigned int next_level = align_block_level(
+        select_block_level(body->ax, body->ay, delta_time, softening_length),
+        substep
+    );
+    *level = (uint8_t) next_level;
+
+    float step = ldexpf(delta_time, -(int) next_level);
+    body->vx += body->ax * 0.5f * step;
+    body->vy += body->ay * 0.5f * step;
+}
+
+typedef struct _active_task {
+    const body_t *bodies;
+    size_t first_body;
+    size_t active_count;
+} active_task_t;
+
+/* Computes the accelerations of the active bodies, which are indices into the slice. */
+static void calculate_active_accelerations_task(void *data, size_t thread_index, size_t thread_count)
+{
+    active_task_t *task = (active_task_t *) data;
+
+    size_t begin, end;
+    thread_team_split(task->active_count, thread_index, thread_count, &begin, &end);
+
+    memset(&active_ax[begin], 0, sizeof(*active_ax) * (end - begin));
+    memset(&active_ay[begin], 0, sizeof(*active_ay) * (end - begin));
+
+    switch (simulation_solver) {
+        case SOLVER_BARNES_HUT:
+            for (size_t i = begin; i < end; ++i) {
+                size_t body_index = task->first_body + active_indices[i];
+                quadtree_calculate_acceleration(
+                    &quadtree,
+                    body_index,
+                    task->bodies[body_index].x, task->bodies[body_index].y,
+                    barnes_hut_theta,
+                    simulation_softening_length_squared,
+                    &active_ax[i], &active_ay[i]
+                );
+            }
+            break;
+        default:
+            /* The reference kernel needs the targets in place, the others take them packed. */
+            if (is_tiled) {
+                force_kernel_tiled(
+                    force_kernel,
+                    &force_kernel_tiling,
+                    active_x, active_y,
+                    begin, end,
+                    &bodies_soa,
+                    simulation_softening_length_squared,
+                    &active_ax[begin], &active_ay[begin]
+                );
+            } else {
+                force_kernel_function_t function =
+                    NULL == force_kernel_function ? force_kernel_scalar : force_kernel_function;
+                function(
+                    active_x, active_y,
+                    begin, end,
+                    &bodies_soa,
+                    simulation_softening_length_squared,
+                    &active_ax[begin], &active_ay[begin]
+                );
+            }
+            break;
+    }
+}
+
+/*
+    Opens the steps of the slice at the start of a simulation step and runs
+    the sub-steps up to the end of it, where the bodies are drifted to the
+    positions of the next simulation step. `bodies` receives the predicted
+    positions of all processes before every force evaluation.
+*/
+static void run_block_steps(
+                body_t *bodies, size_t body_count,
+                body_t *local_bodies, size_t slice_start, size_t slice_size,
+                float delta_time, float softening_length,
+                MPI_Datatype mpi_body_position_t
+            )
+{
+    for (size_t i = 0; i < slice_size; ++i) {
+        open_block_step(&local_bodies[i], &slice_levels[i], 0, delta_time, softening_length);
+    }
+
+    size_t substep_count = (size_t) 1 << block_max_level;
+    float substep_time = ldexpf(delta_time, -(int) block_max_level);
+    for (size_t substep = 1; substep <= substep_count; ++substep) {
+        for (size_t i = 0; i < slice_size; ++i) {
+            body_t *body = &local_bodies[i];
+            body->x += body->vx * substep_time;
+            body->y += body->vy * substep_time;
+        }
+
+        /* The last drift ends the simulation step, where every body is evaluated. */
+        if (substep == substep_count) {
+            break;
+        }
+
+        size_t active_count = 0;
+        for (size_t i = 0; i < slice_size; ++i) {
+            size_t level_steps = (size_t) 1 << (block_max_level - slice_levels[i]);
+            if (0 == substep % level_steps) {
+                active_indices[active_count] = i;
+                active_x[active_count] = local_bodies[i].x;
+                active_y[active_count] = local_bodies[i].y;
+                ++active_count;
+            }
+        }
+
+        unsigned long long total_active_count = active_count;
+        MPI_Allreduce(MPI_IN_PLACE, &total_active_count, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        if (0 == total_active_count) {
+            continue;
+        }
+
+        MPI_Allgatherv(
+            local_bodies, (int) slice_size, mpi_body_position_t,
+            bodies, slice_counts, slice_offsets, mpi_body_position_t,
+            MPI_COMM_WORLD
+        );
+
+        if (!prepare_solver(bodies, body_count)) {
+            fprintf(stderr, "Error: out of memory for the %s solver\n", Solver_Names[simulation_solver]);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+
+        active_task_t task = {
+            .bodies = bodies,
+            .first_body = slice_start,
+            .active_count = active_count
+        };
+        thread_team_run(thread_team, calculate_active_accelerations_task, &task);
+        block_force_evaluations += active_count;
+
+        for (size_t i = 0; i < active_count; ++i) {
+            size_t index = active_indices[i];
+            body_t *body = &local_bodies[index];
+
+            integrate_close_step(body, active_ax[i], active_ay[i], get_block_delta_time(index, delta_time));
+            open_block_step(body, &slice_levels[index], substep, delta_time, softening_length);
+        }
+    }
+}
+
+/*
+    Prints the force evaluations of the run against the ones that global
+    steps of the finest level would need.
+*/
+static void report_block_steps(size_t body_count, size_t iterations, int rank)
+{
+    unsigned long long force_evaluations = block_force_evaluations;
+    MPI_Reduce(
+        0 == rank ? MPI_IN_PLACE : &force_evaluations,
+        &force_evaluations,
+        1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD
+    );
+
+    if (0 != rank) {
+        return;
+    }
+
+    /* Every body is also evaluated once per simulation step. */
+    force_evaluations += (unsigned long long) body_count * iterations;
+    double finest_evaluations = (double) body_count * (double) iterations * (double) ((size_t) 1 << block_max_level);
+    fprintf(
+        stderr,
+        "block time steps: %u levels, force evaluations: %llu, with the finest global step: %.0f (%.1fx)\n",
+        block_max_level + 1,
+        force_evaluations,
+        finest_evaluations,
+        0 < force_evaluations ? finest_evaluations / (double) force_evaluations : 0.0
+    );
+}
+
 int main(int argc, char **argv)
 {
 	int exit_status = EXIT_SUCCESS;
 	
-	MPI_Init(&argc, &argv);
+    /* Only the main thread makes MPI calls, the team threads only compute. */
+    int thread_support = MPI_THREAD_SINGLE;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
 	int w_size, rank;
 	
 	MPI_Comm_size(MPI_COMM_WORLD, &w_size);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
 	MPI_Datatype mpi_body_t = create_body_t();
+    /* Masses are constant, so after the first broadcast only positions are exchanged. */
+	MPI_Datatype mpi_body_position_t = create_body_pair_t(offsetof(body_t, x));
+	MPI_Datatype mpi_body_acceleration_t = create_body_pair_t(offsetof(body_t, ax));
+	MPI_Datatype mpi_acceleration_t;
+    MPI_Type_contiguous(2, MPI_FLOAT, &mpi_acceleration_t);
+    MPI_Type_commit(&mpi_acceleration_t);
+    quadtree_init(&quadtree);
+
+    static const int Base = 10;
+
+    bool are_options_valid = true;
+    bool is_integrator_set = false;
+    for (int option; -1 != (option = getopt(argc, argv, "s:t:b:j:k:rST:RB:f:O:W:I:EH:")); ) {
+        switch (option) {
+            case 's':
+                are_options_valid = false;
+                for (int i = 0; i < SOLVER_COUNT; ++i) {
+                    if (0 == strcmp(optarg, Solver_Names[i])) {
+                        simulation_solver = (solver_t) i;
+                        are_options_valid = true;
+                    }
+                }
+                break;
+            case 't':
+                barnes_hut_theta = strtof(optarg, NULL);
+                break;
+            case 'b':
+                are_options_valid = false;
+                for (int i = 0; i < TREE_BUILDER_COUNT; ++i) {
+                    if (0 == strcmp(optarg, Tree_Builder_Names[i])) {
+                        barnes_hut_tree_builder = (tree_builder_t) i;
+                        are_options_valid = true;
+                    }
+                }
+                break;
+            case 'k':
+                are_options_valid = false;
+                for (int i = 0; i <= FORCE_KERNEL_AUTO; ++i) {
+                    if (0 == strcmp(optarg, Force_Kernel_Names[i])) {
+                        force_kernel = (force_kernel_t) i;
+                        are_options_valid = true;
+                    }
+                }
+                break;
+            case 'f':
+                are_options_valid = false;
+                for (int i = 0; i < OUTPUT_FORMAT_COUNT; ++i) {
+                    if (0 == strcmp(optarg, Output_Format_Names[i])) {
+                        output_format = (output_format_t) i;
+                        are_options_valid = true;
+                    }
+                }
+                break;
+            case 'I':
+                is_integrator_set = true;
+                are_options_valid = false;
+                for (int i = 0; i < INTEGRATOR_COUNT; ++i) {
+                    if (0 == strcmp(optarg, Integrator_Names[i])) {
+                        simulation_integrator = (integrator_t) i;
+                        are_options_valid = true;
+                    }
+                }
+                break;
+            case 'E':
+                should_report_energy = true;
+                break;
+            case 'H': {
+                char *accuracy = NULL;
+                block_max_level = (unsigned int) strtoul(optarg, &accuracy, Base);
+                if (':' == *accuracy) {
+                    block_accuracy = strtof(accuracy + 1, NULL);
+                }
+                break;
+            }
+            case 'W':
+                output_thread_count = (size_t) strtoul(optarg, NULL, Base);
+                break;
+            case 'O':
+                parallel_output_path = optarg;
+                output_format = OUTPUT_FORMAT_BINARY;
+                break;
+            case 'r':
+                should_report_performance = true;
+                break;
+            case 'S':
+                is_symmetric = true;
+                break;
+            case 'R':
+                is_ring = true;
+                break;
+            case 'T': {
+                char *source_tile = NULL;
+                force_kernel_tiling.target_tile = (size_t) strtoul(optarg, &source_tile, Base);
+                if (':' == *source_tile) {
+                    force_kernel_tiling.source_tile = (size_t) strtoul(source_tile + 1, NULL, Base);
+                }
+                is_tiled = true;
+                break;
+            }
+            case 'B':
+                balance_interval = (size_t) strtoul(optarg, NULL, Base);
+                break;
+            case 'j':
+                thread_count = (size_t) strtoul(optarg, NULL, Base);
+                break;
+            default:
+                are_options_valid = false;
+                break;
+        }
+
+        if (!are_options_valid) {
+            break;
+        }
+    }
 
-    if (argc < 6) {
+    if ((is_symmetric || is_tiled || is_ring) && SOLVER_BRUTEFORCE != simulation_solver) {
+        are_options_valid = false;
+    }
+    if (is_symmetric && (is_ring || 0 < balance_interval)) {
+        are_options_valid = false;
+    }
+    if (0 < block_max_level && (is_symmetric || is_ring || Max_Block_Levels < block_max_level)) {
+        are_options_valid = false;
+    }
+    if (0 < block_max_level && is_integrator_set && INTEGRATOR_LEAPFROG != simulation_integrator) {
+        are_options_valid = false;
+    }
+
+    if (!are_options_valid || argc - optind < 5) {
         fprintf(
             stderr,
-            "Error: incorrect number of arguments\n\n"
-            "\tUsage: %s <time period (~10-100)> "
+            "Error: incorrect arguments\n\n"
+            "\tUsage: %s [-s bruteforce|barnes-hut] "
+                        "[-t Barnes-Hut theta (~0.3-1.0)] "
+                        "[-b insertion|morton] "
+                        "[-j threads per process (0 for cores per process)] "
+                        "[-k reference|scalar|avx2|avx512|auto] "
+                        "[-r] "
+                        "[-I euler|leapfrog|verlet] "
+                        "[-E (report the energy drift)] "
+                        "[-H finest block level[:accuracy] (~4:0.025, leapfrog only)] "
+                        "[-f text|binary (output format)] "
+                        "[-W text formatting threads] "
+                        "[-O binary output file written by all processes] "
+                        "[-S (symmetric pairs, bruteforce only)] "
+                        "[-T target tile[:source tile] (~256:2048)] "
+                        "[-R (ring exchange, bruteforce only)] "
+                        "[-B rebalance interval in steps (0 for equal slices)] "
+                        "<time period (~10-100)> "
                         "<delta time (~0.01-0.1)> "
                         "<body count (~100-1000)> "
                         "<initial body mass (~10000)> "
@@ -194,61 +1448,148 @@ int main(int argc, char **argv)
 		goto end;
     }
 
-    float time_period = strtof(argv[1], NULL);
-    float delta_time  = strtof(argv[2], NULL);
-    static const int Base = 10;
-    size_t body_count = (size_t) strtol(argv[3], NULL, Base);
-    initial_body_mass = strtof(argv[4], NULL);
-    float softening_length = strtof(argv[5], NULL);
+    char **arguments = argv + optind;
+    int argument_count = argc - optind;
+
+    float time_period = strtof(arguments[0], NULL);
+    float delta_time  = strtof(arguments[1], NULL);
+    size_t body_count = (size_t) strtol(arguments[2], NULL, Base);
+    initial_body_mass = strtof(arguments[3], NULL);
+    float softening_length = strtof(arguments[4], NULL);
     simulation_softening_length_squared = softening_length * softening_length;
 
-    if (argc > 6) {
-        debug_acceleration_scale = strtof(argv[6], NULL);
+    if (argument_count > 5) {
+        debug_acceleration_scale = strtof(arguments[5], NULL);
     }
 
-    bodies = (body_t *) malloc(sizeof(*bodies) * body_count);
-    assert(bodies != NULL);
+    force_kernel = force_kernel_resolve(force_kernel);
+    if (!force_kernel_is_supported(force_kernel)) {
+        fprintf(
+            stderr,
+            "Error: the %s kernel is not supported on this CPU\n",
+            Force_Kernel_Names[force_kernel]
+        );
 
-	if(rank == 0)
-	{
-	    generate_debug_data(bodies, body_count);
+        exit_status = EXIT_FAILURE;
+        goto end;
+    }
+    force_kernel_function = force_kernel_get_function(force_kernel);
 
-		printf("%zu\n%f\n%f\n", body_count, time_period, delta_time);
-		for (size_t i = 0; i < body_count; ++i) {
-			body_t *body = &bodies[i];
-			printf(
-				"%f %f\n"
-				"%f %f\n"
-				"%f %f\n"
-				"%f\n",
-				body->x,  body->y,
-				body->ax, body->ay,
-				body->vx, body->vy,
-				body->mass
-			);
-		}
-	}
+    /* Block time steps are built on the kicks and drifts of leapfrog, which they select without -I. */
+    if (0 < block_max_level) {
+        simulation_integrator = INTEGRATOR_LEAPFROG;
+    }
+
+    bodies_soa_init(&bodies_soa);
+    for (size_t i = 0; i < sizeof(ring_blocks) / sizeof(ring_blocks[0]); ++i) {
+        bodies_soa_init(&ring_blocks[i]);
+    }
 
-	assert(body_count % w_size == 0);
+    if (0 == thread_count) {
+        thread_count = get_default_thread_count();
+    }
+    if (1 < thread_count && MPI_THREAD_FUNNELED > thread_support && 0 == rank) {
+        fprintf(stderr, "Warning: the MPI library does not support threads\n");
+    }
 
-	size_t bodies_per_process = body_count / w_size;
-	local_bodies = malloc(sizeof(*local_bodies) * bodies_per_process);
-	assert(local_bodies != NULL);
+    thread_team = thread_team_create(thread_count);
+    if (NULL == thread_team) {
+        fprintf(stderr, "Error: failed to start %zu threads on process %d\n", thread_count, rank);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    /* In the ring mode, only the root process needs all bodies (for the output). */
+    if (rank == 0 || !is_ring) {
+        bodies = (body_t *) malloc(sizeof(*bodies) * body_count);
+        assert(bodies != NULL);
+    }
 
     size_t iterations = time_period / delta_time;
-    size_t acceleration_entries = iterations * body_count * 2;
+
 	if(rank == 0)
 	{
-	    accelerations = (float *) malloc(sizeof(*accelerations) * acceleration_entries);
-	    assert(accelerations != NULL);
+	    generate_debug_data(bodies, body_count);
+
+        trajectory_header_t header = {
+            .body_count = body_count,
+            .step_count = iterations,
+            .time_period = time_period,
+            .delta_time = delta_time
+        };
+        setvbuf(stdout, NULL, _IOFBF, Output_Buffer_Size);
+        if (NULL != parallel_output_path) {
+            /* The processes write the file together below. */
+        } else if (OUTPUT_FORMAT_BINARY == output_format) {
+            trajectory_write_header(stdout, &header);
+            trajectory_write_bodies(stdout, bodies, body_count);
+        } else {
+            trajectory_print_header(stdout, &header, bodies);
+        }
+
+        /* From here on, only the writer thread touches stdout. */
+        if (NULL == parallel_output_path) {
+            output_writer = output_writer_create(
+                stdout,
+                output_format,
+                body_count,
+                Output_Step_Buffers,
+                output_thread_count
+            );
+            assert(output_writer != NULL);
+        }
 	}
 
+    if (NULL != parallel_output_path) {
+        trajectory_header_t header = {
+            .body_count = body_count,
+            .step_count = iterations,
+            .time_period = time_period,
+            .delta_time = delta_time
+        };
+        if (!open_parallel_output(&header, bodies, rank)) {
+            if (rank == 0) {
+                fprintf(stderr, "Error: failed to write '%s'\n", parallel_output_path);
+            }
+
+            exit_status = EXIT_FAILURE;
+            goto end;
+        }
+    }
+
+    slice_counts = (int *) malloc(sizeof(*slice_counts) * w_size);
+    slice_offsets = (int *) malloc(sizeof(*slice_offsets) * w_size);
+    slice_weights = (double *) malloc(sizeof(*slice_weights) * w_size);
+    assert(slice_counts != NULL && slice_offsets != NULL && slice_weights != NULL);
+
+    partition_bodies(body_count, NULL, w_size, slice_counts, slice_offsets);
+
+	size_t bodies_per_process = (size_t) slice_counts[rank];
+	size_t slice_start = (size_t) slice_offsets[rank];
+    bool are_slices_reserved = reserve_slice_buffers(bodies_per_process);
+    assert(are_slices_reserved);
+
+    if (0 < block_max_level) {
+        body_levels = (uint8_t *) malloc(sizeof(*body_levels) * (0 == body_count ? 1 : body_count));
+        are_slices_reserved = NULL != body_levels && reserve_block_buffers(bodies_per_process);
+        assert(are_slices_reserved);
+    }
+
 	// BROADCAST
-	MPI_Bcast(bodies, body_count, mpi_body_t, 0, MPI_COMM_WORLD);
-	size_t slice_start = rank * bodies_per_process;
-	//memcpy(local_bodies, bodies + slice_start, sizeof(*local_bodies) * bodies_per_process);
-	
-    for (size_t k = 0, next_acceleration = 0; k < iterations; ++k) {
+    if (is_ring) {
+        MPI_Scatterv(
+            bodies, slice_counts, slice_offsets, mpi_body_t,
+            local_bodies, (int) bodies_per_process, mpi_body_t,
+            0, MPI_COMM_WORLD
+        );
+    } else {
+	    MPI_Bcast(bodies, body_count, mpi_body_t, 0, MPI_COMM_WORLD);
+	    memcpy(local_bodies, bodies + slice_start, sizeof(*local_bodies) * bodies_per_process);
+    }
+
+    double force_time = 0.0;
+    double balance_time = 0.0;
+    double initial_energy = 0.0, final_energy = 0.0;
+    for (size_t k = 0; k < iterations; ++k) {
 #ifdef DEBUG
 		if(rank == 0)
 		{
@@ -256,74 +1597,204 @@ int main(int argc, char **argv)
 		}
 #endif
 
-		body_t* p = local_bodies;
-        for (size_t i = slice_start; i < slice_start + bodies_per_process; ++i) {
-            body_t *first_body = &bodies[i];
+        double force_start_time = MPI_Wtime();
 
-            float total_ax = 0.0f, total_ay = 0.0f;
-            for (size_t j = 0; j < body_count; ++j) {
-                body_t *second_body = &bodies[j];
-                if (first_body == second_body) {
-                    continue;
-                }
-
-                float ax, ay;
-                calculate_newton_gravity_acceleration(
-                    first_body, second_body,
-                    &ax, &ay
-                );
+        if (is_ring) {
+            if (!calculate_ring_accelerations(local_bodies, bodies_per_process, slice_ax, slice_ay, &balance_time)) {
+                fprintf(stderr, "Error: out of memory for the ring exchange\n");
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
 
-                total_ax += ax;
-                total_ay += ay;
+            force_time += MPI_Wtime() - force_start_time;
+        } else {
+            if (!prepare_solver(bodies, body_count)) {
+                fprintf(stderr, "Error: out of memory for the %s solver\n", Solver_Names[simulation_solver]);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
             }
 
-            first_body->ax = total_ax;
-            first_body->ay = total_ay;
+            double slice_start_time = MPI_Wtime();
+            calculate_slice_accelerations(
+                bodies, body_count,
+                slice_start, slice_start + bodies_per_process,
+                slice_ax, slice_ay
+            );
 
-			*p++ = *first_body;
+            balance_time += MPI_Wtime() - slice_start_time;
+            force_time += MPI_Wtime() - force_start_time;
         }
 
-		
-        for (size_t i = 0; i <  bodies_per_process; ++i) {
-            body_t *body = &local_bodies[i];
+        /* Velocities and accelerations of the slice live only in `local_bodies`. */
+        for (size_t i = 0; i < bodies_per_process; ++i) {
+            float close_delta_time = 0 == k ? 0.0f : get_block_delta_time(i, delta_time);
+            integrate_close_step(&local_bodies[i], slice_ax[i], slice_ay[i], close_delta_time);
+        }
 
-            integrate(body, delta_time);
+        /* Positions and velocities are in sync here, at the first and at the last force evaluation. */
+        if (should_report_energy && (0 == k || k + 1 == iterations)) {
+            size_t energy_begin = slice_start, energy_end = slice_start + bodies_per_process;
+            if (is_ring) {
+                MPI_Gatherv(
+                    local_bodies, (int) bodies_per_process, mpi_body_position_t,
+                    bodies, slice_counts, slice_offsets, mpi_body_position_t,
+                    0, MPI_COMM_WORLD
+                );
+                energy_begin = 0;
+                energy_end = rank == 0 ? body_count : 0;
+            }
+
+            double energy = calculate_total_energy(
+                bodies, body_count,
+                energy_begin, energy_end,
+                local_bodies, bodies_per_process
+            );
+            if (0 == k) {
+                initial_energy = energy;
+            }
+            final_energy = energy;
         }
-		
+
 		// GATHER
-		MPI_Allgather(local_bodies, bodies_per_process, mpi_body_t, bodies, bodies_per_process, mpi_body_t, MPI_COMM_WORLD);
-		
-		//memcpy(local_bodies, bodies + slice_start, sizeof(*local_bodies) * bodies_per_process );
+        if (NULL != parallel_output_path) {
+            if (!write_parallel_output_step(k, local_bodies, bodies_per_process, slice_start)) {
+                fprintf(stderr, "Error: failed to write '%s'\n", parallel_output_path);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        } else {
+            /* The root gathers the accelerations straight into a buffer of the writer. */
+            float *step_accelerations = rank == 0 ? output_writer_acquire(output_writer) : NULL;
+            MPI_Gatherv(
+                local_bodies, (int) bodies_per_process, mpi_body_acceleration_t,
+                step_accelerations, slice_counts, slice_offsets, mpi_acceleration_t,
+                0, MPI_COMM_WORLD
+            );
+            if (rank == 0) {
+                output_writer_submit(output_writer);
+            }
+        }
 
-		if(rank == 0)
-		{
-			for(int i = 0; i < body_count; ++i)
-			{
-				body_t *body = &bodies[i];
+        /* The accelerations of the step are sent above, before the sub-steps replace them. */
+        if (0 < block_max_level) {
+            run_block_steps(
+                bodies, body_count,
+                local_bodies, slice_start, bodies_per_process,
+                delta_time, softening_length,
+                mpi_body_position_t
+            );
+        } else {
+            for (size_t i = 0; i < bodies_per_process; ++i) {
+                integrate_open_step(&local_bodies[i], delta_time);
+            }
+        }
 
-				accelerations[next_acceleration++] = body->ax;
-				accelerations[next_acceleration++] = body->ay;
-			}
-		}
+        if (!is_ring) {
+		    MPI_Allgatherv(
+                local_bodies, (int) bodies_per_process, mpi_body_position_t,
+                bodies, slice_counts, slice_offsets, mpi_body_position_t,
+                MPI_COMM_WORLD
+            );
+        }
+
+        if (0 < balance_interval && 0 == (k + 1) % balance_interval && k + 1 < iterations) {
+            /* The new slices need the velocities (and levels) too, so the whole bodies are collected once. */
+            if (is_ring) {
+                MPI_Gatherv(
+                    local_bodies, (int) bodies_per_process, mpi_body_t,
+                    bodies, slice_counts, slice_offsets, mpi_body_t,
+                    0, MPI_COMM_WORLD
+                );
+            } else {
+                MPI_Allgatherv(
+                    local_bodies, (int) bodies_per_process, mpi_body_t,
+                    bodies, slice_counts, slice_offsets, mpi_body_t,
+                    MPI_COMM_WORLD
+                );
+                if (0 < block_max_level) {
+                    MPI_Allgatherv(
+                        slice_levels, (int) bodies_per_process, MPI_UNSIGNED_CHAR,
+                        body_levels, slice_counts, slice_offsets, MPI_UNSIGNED_CHAR,
+                        MPI_COMM_WORLD
+                    );
+                }
+            }
+
+            rebalance_slices(body_count, balance_time, w_size);
+            balance_time = 0.0;
+
+            bodies_per_process = (size_t) slice_counts[rank];
+            slice_start = (size_t) slice_offsets[rank];
+            if (!reserve_slice_buffers(bodies_per_process)) {
+                fprintf(stderr, "Error: out of memory for the slice of %zu bodies\n", bodies_per_process);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+
+            /* Without the ring, every process already has all bodies. */
+            if (is_ring) {
+                MPI_Scatterv(
+                    bodies, slice_counts, slice_offsets, mpi_body_t,
+                    local_bodies, (int) bodies_per_process, mpi_body_t,
+                    0, MPI_COMM_WORLD
+                );
+            } else {
+                memcpy(local_bodies, bodies + slice_start, sizeof(*local_bodies) * bodies_per_process);
+            }
+
+            if (0 < block_max_level) {
+                if (!reserve_block_buffers(bodies_per_process)) {
+                    fprintf(stderr, "Error: out of memory for the slice of %zu bodies\n", bodies_per_process);
+                    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+                }
+                memcpy(slice_levels, body_levels + slice_start, sizeof(*slice_levels) * bodies_per_process);
+            }
+        }
     }
 		
 
-	if(rank == 0)
-	{
-		for (size_t i = 0; i < acceleration_entries; i += 2) {
-			printf("%f %f\n", accelerations[i], accelerations[i + 1]);
-		}
-	}
+    if (should_report_performance) {
+        report_performance(body_count, iterations, force_time, rank);
+    }
+    if (should_report_energy) {
+        report_energy(initial_energy, final_energy, rank);
+    }
+    if (should_report_performance && 0 < block_max_level) {
+        report_block_steps(body_count, iterations, rank);
+    }
+
+    if (!output_writer_destroy(output_writer)) {
+        fprintf(stderr, "Error: failed to write the output\n");
+        exit_status = EXIT_FAILURE;
+    }
+    output_writer = NULL;
 
 end:
+    if (!close_parallel_output()) {
+        exit_status = EXIT_FAILURE;
+    }
+
 	MPI_Finalize();
 
-	if(!accelerations)
-	{
-    	free(accelerations);
-    	accelerations = NULL;
-	}
-	
+    quadtree_deinit(&quadtree);
+    bodies_soa_deinit(&bodies_soa);
+    for (size_t i = 0; i < sizeof(ring_blocks) / sizeof(ring_blocks[0]); ++i) {
+        bodies_soa_deinit(&ring_blocks[i]);
+    }
+    thread_team_destroy(thread_team);
+
+    free(local_bodies);
+    free(slice_ax);
+    free(slice_ay);
+    free(slice_counts);
+    free(slice_offsets);
+    free(slice_weights);
+    free(symmetric_ax);
+    free(symmetric_ay);
+    free(slice_levels);
+    free(body_levels);
+    free(active_indices);
+    free(active_x);
+    free(active_y);
+    free(active_ax);
+    free(active_ay);
+
 	if(!bodies)
 	{
     	free(bodies);
@@ -0,0 +1,250 @@
+#include "body.h"
+#include "force_kernels.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+    Measures the pairwise interactions per second of every force kernel
+    that the CPU supports against the reference loop over `body_t`, for a
+    range of body counts. Results are written as CSV.
+
+    With --tiles N, sweeps the target and source tile sizes of the tiled
+    kernel for N bodies instead.
+*/
+
+static const size_t Default_Max_Body_Count = 16384;
+static const size_t Target_Tiles[] = { 16, 64, 256, 1024, 4096 };
+static const size_t Source_Tiles[] = { 256, 1024, 4096, 16384, 65536 };
+static const size_t Min_Body_Count = 1024;
+static const double Min_Measurement_Time = 0.25;
+static const float Softening_Length_Squared = 100.0f * 100.0f;
+
+static uint64_t get_monotonic_time_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+}
+
+static float unit_random(void)
+{
+    return (float) rand() / (float) RAND_MAX;
+}
+
+static void generate_bodies(body_t *bodies, size_t body_count)
+{
+    for (size_t i = 0; i < body_count; ++i) {
+        body_t *body = &bodies[i];
+
+        body->x = unit_random() * 1000.0f;
+        body->y = unit_random() * 1000.0f;
+        body->ax = body->ay = 0.0f;
+        body->vx = body->vy = 0.0f;
+        body->mass = 10000.0f * (unit_random() + 0.5f);
+    }
+}
+
+/* A NULL tiling runs the untiled kernel. */
+static void run_kernel(
+                force_kernel_t kernel,
+                const force_kernel_tiling_t *tiling,
+                const body_t *bodies,
+                const bodies_soa_t *soa,
+                float *ax, float *ay
+            )
+{
+    size_t body_count = soa->count;
+
+    memset(ax, 0, sizeof(*ax) * body_count);
+    memset(ay, 0, sizeof(*ay) * body_count);
+
+    if (NULL != tiling) {
+        force_kernel_tiled(
+            kernel,
+            tiling,
+            soa->x, soa->y,
+            0, body_count,
+            soa,
+            Softening_Length_Squared,
+            ax, ay
+        );
+    } else if (FORCE_KERNEL_REFERENCE == kernel) {
+        force_kernel_reference(
+            bodies, body_count,
+            0, body_count,
+            Softening_Length_Squared,
+            ax, ay
+        );
+    } else {
+        force_kernel_get_function(kernel)(
+            soa->x, soa->y,
+            0, body_count,
+            soa,
+            Softening_Length_Squared,
+            ax, ay
+        );
+    }
+}
+
+/* Returns the seconds per call, repeating the kernel for a stable measurement. */
+static double measure_kernel(
+                  force_kernel_t kernel,
+                  const force_kernel_tiling_t *tiling,
+                  const body_t *bodies,
+                  const bodies_soa_t *soa,
+                  float *ax, float *ay
+              )
+{
+    run_kernel(kernel, tiling, bodies, soa, ax, ay);
+
+    size_t repetitions = 0;
+    uint64_t start = get_monotonic_time_ns();
+    double elapsed = 0.0;
+    do {
+        run_kernel(kernel, tiling, bodies, soa, ax, ay);
+        ++repetitions;
+        elapsed = (double) (get_monotonic_time_ns() - start) * 1e-9;
+    } while (elapsed < Min_Measurement_Time);
+
+    return elapsed / (double) repetitions;
+}
+
+static void run_kernel_benchmark(
+                size_t max_body_count,
+                body_t *bodies,
+                bodies_soa_t *soa,
+                float *ax, float *ay
+            )
+{
+    printf("kernel,bodies,seconds_per_step,interactions_per_second,speedup\n");
+    for (size_t body_count = Min_Body_Count; body_count <= max_body_count; body_count *= 4) {
+        generate_bodies(bodies, body_count);
+        bodies_soa_load(soa, bodies, body_count);
+
+        double interactions = (double) body_count * (double) (body_count - 1);
+        double reference_time = 0.0;
+        for (int kernel = FORCE_KERNEL_REFERENCE; kernel < FORCE_KERNEL_COUNT; ++kernel) {
+            if (!force_kernel_is_supported((force_kernel_t) kernel)) {
+                continue;
+            }
+
+            double time = measure_kernel((force_kernel_t) kernel, NULL, bodies, soa, ax, ay);
+            if (FORCE_KERNEL_REFERENCE == kernel) {
+                reference_time = time;
+            }
+
+            printf(
+                "%s,%zu,%.6f,%.3e,%.2f\n",
+                Force_Kernel_Names[kernel],
+                body_count,
+                time,
+                interactions / time,
+                reference_time / time
+            );
+            fflush(stdout);
+        }
+    }
+}
+
+static void run_tile_benchmark(
+                size_t body_count,
+                body_t *bodies,
+                bodies_soa_t *soa,
+                float *ax, float *ay
+            )
+{
+    static const size_t Target_Tile_Count = sizeof(Target_Tiles) / sizeof(Target_Tiles[0]);
+    static const size_t Source_Tile_Count = sizeof(Source_Tiles) / sizeof(Source_Tiles[0]);
+
+    force_kernel_t kernel = force_kernel_resolve(FORCE_KERNEL_AUTO);
+
+    generate_bodies(bodies, body_count);
+    bodies_soa_load(soa, bodies, body_count);
+
+    double interactions = (double) body_count * (double) (body_count - 1);
+    double untiled_time = measure_kernel(kernel, NULL, bodies, soa, ax, ay);
+
+    printf("kernel,bodies,target_tile,source_tile,seconds_per_step,interactions_per_second,speedup\n");
+    printf(
+        "%s,%zu,0,0,%.6f,%.3e,1.00\n",
+        Force_Kernel_Names[kernel],
+        body_count,
+        untiled_time,
+        interactions / untiled_time
+    );
+    fflush(stdout);
+
+    for (size_t i = 0; i < Target_Tile_Count; ++i) {
+        for (size_t j = 0; j < Source_Tile_Count; ++j) {
+            force_kernel_tiling_t tiling = {
+                .target_tile = Target_Tiles[i],
+                .source_tile = Source_Tiles[j]
+            };
+
+            double time = measure_kernel(kernel, &tiling, bodies, soa, ax, ay);
+            printf(
+                "%s,%zu,%zu,%zu,%.6f,%.3e,%.2f\n",
+                Force_Kernel_Names[kernel],
+                body_count,
+                tiling.target_tile,
+                tiling.source_tile,
+                time,
+                interactions / time,
+                untiled_time / time
+            );
+            fflush(stdout);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const int Base = 10;
+
+    size_t max_body_count = Default_Max_Body_Count;
+    size_t tile_body_count = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--max-bodies") && i + 1 < argc) {
+            max_body_count = (size_t) strtoul(argv[++i], NULL, Base);
+        } else if (0 == strcmp(argv[i], "--tiles") && i + 1 < argc) {
+            tile_body_count = (size_t) strtoul(argv[++i], NULL, Base);
+        } else {
+            fprintf(stderr, "Usage: %s [--max-bodies N] [--tiles N]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t body_count = tile_body_count > max_body_count ? tile_body_count : max_body_count;
+    body_t *bodies = (body_t *) malloc(sizeof(*bodies) * body_count);
+    float *ax = (float *) malloc(sizeof(*ax) * body_count);
+    float *ay = (float *) malloc(sizeof(*ay) * body_count);
+
+    bodies_soa_t soa;
+    bodies_soa_init(&soa);
+
+    if (NULL == bodies || NULL == ax || NULL == ay || NULL == bodies_soa_resize(&soa, body_count)) {
+        fputs("Out of memory.\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    srand(42);
+
+    if (0 < tile_body_count) {
+        run_tile_benchmark(tile_body_count, bodies, &soa, ax, ay);
+    } else {
+        run_kernel_benchmark(max_body_count, bodies, &soa, ax, ay);
+    }
+
+    bodies_soa_deinit(&soa);
+    free(bodies);
+    free(ax);
+    free(ay);
+
+    return EXIT_SUCCESS;
+}
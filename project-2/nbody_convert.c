@@ -0,0 +1,98 @@
+#include "body.h"
+#include "trajectory.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Converts a binary trajectory (`nbody-mpi -f binary`) to the text
+    format that the Unity replay reads, with the same bytes as the text
+    output of the simulation itself. Reads one step at a time, so memory
+    does not grow with the number of steps.
+*/
+
+static const size_t Output_Buffer_Size = 1 << 22;
+
+static bool convert(FILE *input, FILE *output)
+{
+    trajectory_header_t header;
+    if (!trajectory_read_header(input, &header)) {
+        fputs("Error: not a binary trajectory\n", stderr);
+        return false;
+    }
+
+    size_t body_count = (size_t) header.body_count;
+    body_t *bodies = (body_t *) malloc(sizeof(*bodies) * (0 == body_count ? 1 : body_count));
+    float *accelerations = (float *) malloc(sizeof(*accelerations) * 2 * (0 == body_count ? 1 : body_count));
+    if (NULL == bodies || NULL == accelerations) {
+        fputs("Error: out of memory\n", stderr);
+        free(bodies);
+        free(accelerations);
+        return false;
+    }
+
+    bool is_converted = trajectory_read_bodies(input, bodies, body_count);
+    bool is_written = true;
+    if (is_converted) {
+        is_written = trajectory_print_header(output, &header, bodies);
+    }
+
+    for (uint64_t step = 0; is_converted && is_written && step < header.step_count; ++step) {
+        is_converted = trajectory_read_floats(input, accelerations, 2 * body_count);
+        if (is_converted) {
+            is_written = trajectory_print_accelerations(output, accelerations, body_count);
+        }
+    }
+
+    if (!is_converted) {
+        fputs("Error: the trajectory is truncated\n", stderr);
+    }
+    if (!is_written) {
+        fputs("Error: failed to write the output\n", stderr);
+    }
+
+    free(bodies);
+    free(accelerations);
+
+    return is_converted && is_written;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <binary trajectory | -> [text output]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *input = 0 == strcmp(argv[1], "-") ? stdin : fopen(argv[1], "rb");
+    if (NULL == input) {
+        fprintf(stderr, "Error: failed to open '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *output = 3 == argc ? fopen(argv[2], "w") : stdout;
+    if (NULL == output) {
+        fprintf(stderr, "Error: failed to create '%s'\n", argv[2]);
+        fclose(input);
+        return EXIT_FAILURE;
+    }
+    setvbuf(output, NULL, _IOFBF, Output_Buffer_Size);
+
+    bool is_converted = convert(input, output);
+    if (0 != fflush(output)) {
+        fputs("Error: failed to write the output\n", stderr);
+        is_converted = false;
+    }
+
+    if (stdin != input) {
+        fclose(input);
+    }
+    if (stdout != output) {
+        fclose(output);
+    }
+
+    return is_converted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,261 @@
+#ifndef OUTPUT_WRITER_H
+#define OUTPUT_WRITER_H
+
+#include "thread_team.h"
+#include "trajectory.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+    Writes the accelerations of every step on a thread of its own, so the
+    formatting and the writes of one step overlap with the computation of
+    the next ones.
+
+    Steps go through a bounded ring of buffers: the simulation takes a
+    free buffer with `output_writer_acquire`, fills it with the "ax ay"
+    pairs of all bodies and hands it over with `output_writer_submit`.
+    When the writer falls behind, `output_writer_acquire` waits, so memory
+    stays at `buffer_count` steps no matter how long the run is.
+
+    Text is formatted by a team of threads in rounds: every member formats
+    a contiguous range of lines into its own buffer, and the writer then
+    writes the buffers in member order, so the output keeps its order.
+*/
+
+/* Lines that one member formats per round. */
+#define Output_Writer_Lines_Per_Thread 4096
+#define Output_Writer_Text_Size (Output_Writer_Lines_Per_Thread * TRAJECTORY_MAX_LINE_LENGTH)
+
+typedef struct _output_writer
+{
+    FILE *file;
+    output_format_t format;
+
+    float *buffers;
+    size_t step_size;
+    size_t buffer_count;
+
+    thread_team_t *team;
+    char *texts;
+    size_t *text_lengths;
+
+    /* Steps submitted by the simulation and steps written by the writer. */
+    size_t submitted_count;
+    size_t written_count;
+    bool is_closing;
+    bool has_failed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted_condition;
+    pthread_cond_t written_condition;
+    pthread_t thread;
+} output_writer_t;
+
+typedef struct _output_writer_task {
+    output_writer_t *writer;
+    const float *accelerations;
+    size_t begin, end;
+} output_writer_task_t;
+
+static void _output_writer_format_task(void *data, size_t thread_index, size_t thread_count)
+{
+    output_writer_task_t *task = (output_writer_task_t *) data;
+    output_writer_t *writer = task->writer;
+
+    size_t begin, end;
+    thread_team_split(task->end - task->begin, thread_index, thread_count, &begin, &end);
+    begin += task->begin;
+    end += task->begin;
+
+    writer->text_lengths[thread_index] = trajectory_format_accelerations(
+        &writer->texts[thread_index * Output_Writer_Text_Size],
+        &task->accelerations[2 * begin],
+        end - begin
+    );
+}
+
+static bool _output_writer_print_text(output_writer_t *writer, const float *accelerations)
+{
+    size_t thread_count = thread_team_get_thread_count(writer->team);
+    size_t line_count = writer->step_size / 2;
+    size_t round_size = thread_count * Output_Writer_Lines_Per_Thread;
+
+    for (size_t begin = 0; begin < line_count; begin += round_size) {
+        output_writer_task_t task = {
+            .writer = writer,
+            .accelerations = accelerations,
+            .begin = begin,
+            .end = line_count - begin < round_size ? line_count : begin + round_size
+        };
+        thread_team_run(writer->team, _output_writer_format_task, &task);
+
+        for (size_t i = 0; i < thread_count; ++i) {
+            size_t length = writer->text_lengths[i];
+            if (length != fwrite(&writer->texts[i * Output_Writer_Text_Size], 1, length, writer->file)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void *_output_writer_start(void *args)
+{
+    output_writer_t *writer = (output_writer_t *) args;
+
+    while (true) {
+        pthread_mutex_lock(&writer->mutex);
+        while (writer->written_count == writer->submitted_count && !writer->is_closing) {
+            pthread_cond_wait(&writer->submitted_condition, &writer->mutex);
+        }
+        if (writer->written_count == writer->submitted_count) {
+            pthread_mutex_unlock(&writer->mutex);
+            break;
+        }
+        size_t slot = writer->written_count % writer->buffer_count;
+        pthread_mutex_unlock(&writer->mutex);
+
+        /* The slot belongs to the writer until `written_count` moves past it. */
+        const float *accelerations = &writer->buffers[slot * writer->step_size];
+        bool is_written = OUTPUT_FORMAT_BINARY == writer->format ?
+            trajectory_write_floats(writer->file, accelerations, writer->step_size) :
+            _output_writer_print_text(writer, accelerations);
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->has_failed = writer->has_failed || !is_written;
+        writer->written_count += 1;
+        pthread_cond_signal(&writer->written_condition);
+        pthread_mutex_unlock(&writer->mutex);
+    }
+
+    return NULL;
+}
+
+static void _output_writer_free(output_writer_t *writer)
+{
+    thread_team_destroy(writer->team);
+    free(writer->texts);
+    free(writer->text_lengths);
+    free(writer->buffers);
+    free(writer);
+}
+
+/*
+    Starts a writer for steps of `body_count` pairs of accelerations, with
+    `thread_count` threads for text formatting. The file must not be used
+    by anyone else until the writer is destroyed.
+*/
+static output_writer_t *output_writer_create(
+                           FILE *file,
+                           output_format_t format,
+                           size_t body_count,
+                           size_t buffer_count,
+                           size_t thread_count
+                       )
+{
+    output_writer_t *writer = (output_writer_t *) malloc(sizeof(*writer));
+    if (NULL == writer) {
+        return NULL;
+    }
+
+    writer->file = file;
+    writer->format = format;
+    writer->step_size = 2 * body_count;
+    writer->buffer_count = 0 == buffer_count ? 1 : buffer_count;
+    writer->submitted_count = 0;
+    writer->written_count = 0;
+    writer->is_closing = false;
+    writer->has_failed = false;
+
+    writer->texts = NULL;
+    writer->text_lengths = NULL;
+
+    size_t buffer_size = writer->step_size * writer->buffer_count;
+    writer->buffers = (float *) malloc(sizeof(*writer->buffers) * (0 == buffer_size ? 1 : buffer_size));
+    writer->team = thread_team_create(OUTPUT_FORMAT_TEXT == format ? thread_count : 1);
+    if (NULL == writer->buffers || NULL == writer->team) {
+        _output_writer_free(writer);
+        return NULL;
+    }
+
+    if (OUTPUT_FORMAT_TEXT == format) {
+        size_t team_size = thread_team_get_thread_count(writer->team);
+        writer->texts = (char *) malloc(Output_Writer_Text_Size * team_size);
+        writer->text_lengths = (size_t *) malloc(sizeof(*writer->text_lengths) * team_size);
+        if (NULL == writer->texts || NULL == writer->text_lengths) {
+            _output_writer_free(writer);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->submitted_condition, NULL);
+    pthread_cond_init(&writer->written_condition, NULL);
+
+    if (0 != pthread_create(&writer->thread, NULL, _output_writer_start, writer)) {
+        pthread_cond_destroy(&writer->written_condition);
+        pthread_cond_destroy(&writer->submitted_condition);
+        pthread_mutex_destroy(&writer->mutex);
+        _output_writer_free(writer);
+
+        return NULL;
+    }
+
+    return writer;
+}
+
+/* Waits for a free buffer and returns it for `2 * body_count` floats. */
+static float *output_writer_acquire(output_writer_t *writer)
+{
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->submitted_count - writer->written_count == writer->buffer_count) {
+        pthread_cond_wait(&writer->written_condition, &writer->mutex);
+    }
+    size_t slot = writer->submitted_count % writer->buffer_count;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return &writer->buffers[slot * writer->step_size];
+}
+
+/* Hands the buffer of the last `output_writer_acquire` to the writer. */
+static void output_writer_submit(output_writer_t *writer)
+{
+    pthread_mutex_lock(&writer->mutex);
+    writer->submitted_count += 1;
+    pthread_cond_signal(&writer->submitted_condition);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+/*
+    Writes the remaining steps, flushes the file and stops the writer.
+    Returns false if any write failed. A NULL writer succeeds.
+*/
+static bool output_writer_destroy(output_writer_t *writer)
+{
+    if (NULL == writer) {
+        return true;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->is_closing = true;
+    pthread_cond_signal(&writer->submitted_condition);
+    pthread_mutex_unlock(&writer->mutex);
+
+    pthread_join(writer->thread, NULL);
+
+    bool is_written = !writer->has_failed && 0 == fflush(writer->file);
+
+    pthread_cond_destroy(&writer->written_condition);
+    pthread_cond_destroy(&writer->submitted_condition);
+    pthread_mutex_destroy(&writer->mutex);
+    _output_writer_free(writer);
+
+    return is_written;
+}
+
+#endif // OUTPUT_WRITER_H
@@ -0,0 +1,225 @@
+#ifndef THREAD_TEAM_H
+#define THREAD_TEAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+    A fixed team of threads that runs one function on all of its members at
+    once (SPMD style) and returns when every member is done. The calling
+    thread takes part as member zero, so a team of one creates no threads.
+    Inside the function, members can synchronize with `thread_team_barrier`.
+*/
+
+typedef void (*thread_team_function_t)(void *data, size_t thread_index, size_t thread_count);
+
+typedef struct _thread_team
+{
+    pthread_t *threads;
+    size_t thread_count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start_condition;
+    size_t generation;
+    bool is_stopping;
+
+    thread_team_function_t function;
+    void *data;
+
+    pthread_barrier_t barrier;
+} thread_team_t;
+
+typedef struct _thread_team_member
+{
+    thread_team_t *team;
+    size_t index;
+} thread_team_member_t;
+
+static void *_thread_team_start(void *args)
+{
+    thread_team_member_t *member = (thread_team_member_t *) args;
+    thread_team_t *team = member->team;
+    size_t index = member->index;
+    free(member);
+
+    size_t generation = 0;
+    while (true) {
+        pthread_mutex_lock(&team->mutex);
+        while (generation == team->generation && !team->is_stopping) {
+            pthread_cond_wait(&team->start_condition, &team->mutex);
+        }
+        generation = team->generation;
+        bool is_stopping = team->is_stopping;
+        thread_team_function_t function = team->function;
+        void *data = team->data;
+        pthread_mutex_unlock(&team->mutex);
+
+        if (is_stopping) {
+            break;
+        }
+
+        function(data, index, team->thread_count);
+        pthread_barrier_wait(&team->barrier);
+    }
+
+    return NULL;
+}
+
+static inline thread_team_t *thread_team_allocate(void)
+{
+    return (thread_team_t *) malloc(sizeof(thread_team_t));
+}
+
+/* Stops and joins the members [1, member_count), which must be idle. */
+static void _thread_team_stop(thread_team_t *team, size_t member_count)
+{
+    pthread_mutex_lock(&team->mutex);
+    team->is_stopping = true;
+    pthread_cond_broadcast(&team->start_condition);
+    pthread_mutex_unlock(&team->mutex);
+
+    for (size_t i = 1; i < member_count; ++i) {
+        pthread_join(team->threads[i], NULL);
+    }
+}
+
+static thread_team_t *thread_team_init(thread_team_t *team, size_t thread_count)
+{
+    team->thread_count = 0 == thread_count ? 1 : thread_count;
+    team->generation = 0;
+    team->is_stopping = false;
+    team->function = NULL;
+    team->data = NULL;
+
+    team->threads = (pthread_t *) malloc(sizeof(*team->threads) * team->thread_count);
+    if (NULL == team->threads) {
+        return NULL;
+    }
+
+    if (0 != pthread_mutex_init(&team->mutex, NULL)) {
+        free(team->threads);
+
+        return NULL;
+    }
+
+    if (0 != pthread_cond_init(&team->start_condition, NULL)) {
+        pthread_mutex_destroy(&team->mutex);
+        free(team->threads);
+
+        return NULL;
+    }
+
+    if (0 != pthread_barrier_init(&team->barrier, NULL, (unsigned int) team->thread_count)) {
+        pthread_cond_destroy(&team->start_condition);
+        pthread_mutex_destroy(&team->mutex);
+        free(team->threads);
+
+        return NULL;
+    }
+
+    for (size_t i = 1; i < team->thread_count; ++i) {
+        thread_team_member_t *member = (thread_team_member_t *) malloc(sizeof(*member));
+        if (NULL != member) {
+            member->team = team;
+            member->index = i;
+        }
+
+        if (NULL == member || 0 != pthread_create(&team->threads[i], NULL, _thread_team_start, member)) {
+            free(member);
+            _thread_team_stop(team, i);
+
+            pthread_barrier_destroy(&team->barrier);
+            pthread_cond_destroy(&team->start_condition);
+            pthread_mutex_destroy(&team->mutex);
+            free(team->threads);
+
+            return NULL;
+        }
+    }
+
+    return team;
+}
+
+static inline thread_team_t *thread_team_create(size_t thread_count)
+{
+    thread_team_t *team = thread_team_allocate();
+    if (NULL == team) {
+        return team;
+    }
+
+    if (NULL == thread_team_init(team, thread_count)) {
+        free(team);
+
+        return NULL;
+    }
+
+    return team;
+}
+
+static void thread_team_destroy(thread_team_t *team)
+{
+    if (NULL == team) {
+        return;
+    }
+
+    _thread_team_stop(team, team->thread_count);
+
+    pthread_barrier_destroy(&team->barrier);
+    pthread_cond_destroy(&team->start_condition);
+    pthread_mutex_destroy(&team->mutex);
+
+    free(team->threads);
+    free(team);
+}
+
+static inline size_t thread_team_get_thread_count(const thread_team_t *team)
+{
+    return NULL == team ? 1 : team->thread_count;
+}
+
+/* Waits for all members of the team. Only valid inside `thread_team_run`. */
+static inline void thread_team_barrier(thread_team_t *team)
+{
+    if (NULL != team && 1 < team->thread_count) {
+        pthread_barrier_wait(&team->barrier);
+    }
+}
+
+/* A NULL team runs the function on the calling thread alone. */
+static void thread_team_run(thread_team_t *team, thread_team_function_t function, void *data)
+{
+    if (NULL == team || 1 == team->thread_count) {
+        function(data, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&team->mutex);
+    team->function = function;
+    team->data = data;
+    team->generation += 1;
+    pthread_cond_broadcast(&team->start_condition);
+    pthread_mutex_unlock(&team->mutex);
+
+    function(data, 0, team->thread_count);
+    pthread_barrier_wait(&team->barrier);
+}
+
+/* Splits [0, count) into contiguous, nearly equal ranges. */
+static inline void thread_team_split(
+                       size_t count,
+                       size_t thread_index,
+                       size_t thread_count,
+                       size_t *begin,
+                       size_t *end
+                   )
+{
+    size_t chunk = count / thread_count;
+    size_t remainder = count % thread_count;
+
+    *begin = thread_index * chunk + (thread_index < remainder ? thread_index : remainder);
+    *end = *begin + chunk + (thread_index < remainder ? 1 : 0);
+}
+
+#endif // THREAD_TEAM_H
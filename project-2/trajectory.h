@@ -0,0 +1,365 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "body.h"
+#include "float_format.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+    Simulation output in the text format that the Unity replay reads, and
+    in an equivalent binary format that needs no formatting at all.
+
+    The text format is the header (body count, time period and delta
+    time), seven lines for every body, and then an "ax ay" line for every
+    body at every step.
+
+    The binary format holds the same values in the same order, as
+    little-endian numbers:
+
+        char     magic[8]                   "NBODYTRJ"
+        uint32_t version                    1
+        uint32_t header size                40, the bytes up to the bodies
+        uint64_t body count
+        uint64_t step count
+        float    time period
+        float    delta time
+        float    bodies[body count][7]      x, y, ax, ay, vx, vy, mass
+        float    accelerations[step count][body count][2]
+*/
+
+#define TRAJECTORY_MAGIC "NBODYTRJ"
+#define TRAJECTORY_MAGIC_SIZE 8
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_HEADER_SIZE 40
+#define TRAJECTORY_BODY_FIELDS 7
+
+/* Floats that are converted at once on big-endian hosts and for bodies. */
+#define Trajectory_Chunk_Size 4096
+
+/* Types */
+
+typedef enum _output_format {
+    OUTPUT_FORMAT_TEXT,
+    OUTPUT_FORMAT_BINARY,
+    OUTPUT_FORMAT_COUNT
+} output_format_t;
+
+static const char *const Output_Format_Names[] = {
+    "text",
+    "binary"
+};
+
+typedef struct _trajectory_header {
+    uint64_t body_count;
+    uint64_t step_count;
+    float time_period;
+    float delta_time;
+} trajectory_header_t;
+
+/* Byte Order */
+
+static inline bool _trajectory_is_little_endian(void)
+{
+    const uint16_t value = 1;
+
+    return 1 == *(const uint8_t *) &value;
+}
+
+static inline void _trajectory_encode(uint8_t *bytes, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+static inline uint64_t _trajectory_decode(const uint8_t *bytes, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value |= (uint64_t) bytes[i] << (8 * i);
+    }
+
+    return value;
+}
+
+static inline uint32_t _trajectory_float_to_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    return bits;
+}
+
+static inline float _trajectory_bits_to_float(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+/* Binary */
+
+/* Byte offset of the accelerations of the first step. */
+static inline uint64_t trajectory_get_data_offset(const trajectory_header_t *header)
+{
+    return TRAJECTORY_HEADER_SIZE + header->body_count * TRAJECTORY_BODY_FIELDS * sizeof(float);
+}
+
+/* Byte offset of the accelerations of `body` at `step`. */
+static inline uint64_t trajectory_get_acceleration_offset(
+                           const trajectory_header_t *header,
+                           uint64_t step,
+                           uint64_t body
+                       )
+{
+    return trajectory_get_data_offset(header) + (step * header->body_count + body) * 2 * sizeof(float);
+}
+
+static inline uint64_t trajectory_get_size(const trajectory_header_t *header)
+{
+    return trajectory_get_acceleration_offset(header, header->step_count, 0);
+}
+
+static inline void trajectory_encode_header(uint8_t *bytes, const trajectory_header_t *header)
+{
+    memcpy(bytes, TRAJECTORY_MAGIC, TRAJECTORY_MAGIC_SIZE);
+    _trajectory_encode(&bytes[8], TRAJECTORY_VERSION, 4);
+    _trajectory_encode(&bytes[12], TRAJECTORY_HEADER_SIZE, 4);
+    _trajectory_encode(&bytes[16], header->body_count, 8);
+    _trajectory_encode(&bytes[24], header->step_count, 8);
+    _trajectory_encode(&bytes[32], _trajectory_float_to_bits(header->time_period), 4);
+    _trajectory_encode(&bytes[36], _trajectory_float_to_bits(header->delta_time), 4);
+}
+
+static inline bool trajectory_write_header(FILE *file, const trajectory_header_t *header)
+{
+    uint8_t bytes[TRAJECTORY_HEADER_SIZE];
+    trajectory_encode_header(bytes, header);
+
+    return 1 == fwrite(bytes, sizeof(bytes), 1, file);
+}
+
+/* Returns false for a truncated file or a file in another format. */
+static inline bool trajectory_read_header(FILE *file, trajectory_header_t *header)
+{
+    uint8_t bytes[TRAJECTORY_HEADER_SIZE];
+    if (1 != fread(bytes, sizeof(bytes), 1, file)) {
+        return false;
+    }
+
+    if (0 != memcmp(bytes, TRAJECTORY_MAGIC, TRAJECTORY_MAGIC_SIZE) ||
+            TRAJECTORY_VERSION != _trajectory_decode(&bytes[8], 4)) {
+        return false;
+    }
+
+    /* Later versions may append fields to the header. */
+    uint64_t header_size = _trajectory_decode(&bytes[12], 4);
+    if (header_size < TRAJECTORY_HEADER_SIZE) {
+        return false;
+    }
+    for (uint64_t i = TRAJECTORY_HEADER_SIZE; i < header_size; ++i) {
+        if (EOF == fgetc(file)) {
+            return false;
+        }
+    }
+
+    header->body_count = _trajectory_decode(&bytes[16], 8);
+    header->step_count = _trajectory_decode(&bytes[24], 8);
+    header->time_period = _trajectory_bits_to_float((uint32_t) _trajectory_decode(&bytes[32], 4));
+    header->delta_time = _trajectory_bits_to_float((uint32_t) _trajectory_decode(&bytes[36], 4));
+
+    return true;
+}
+
+/*
+    Writes the floats as little-endian. On little-endian hosts, that is a
+    single `fwrite` of the array, otherwise the bytes are swapped in chunks.
+*/
+static inline bool trajectory_write_floats(FILE *file, const float *values, size_t count)
+{
+    if (_trajectory_is_little_endian()) {
+        return count == fwrite(values, sizeof(*values), count, file);
+    }
+
+    uint8_t bytes[Trajectory_Chunk_Size * sizeof(float)];
+    for (size_t begin = 0; begin < count; begin += Trajectory_Chunk_Size) {
+        size_t chunk = count - begin < Trajectory_Chunk_Size ? count - begin : Trajectory_Chunk_Size;
+        for (size_t i = 0; i < chunk; ++i) {
+            _trajectory_encode(&bytes[i * sizeof(float)], _trajectory_float_to_bits(values[begin + i]), sizeof(float));
+        }
+        if (chunk != fwrite(bytes, sizeof(float), chunk, file)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Converts floats in place to their little-endian file representation. */
+static inline void trajectory_encode_floats(float *values, size_t count)
+{
+    if (_trajectory_is_little_endian()) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t bytes[sizeof(float)];
+        _trajectory_encode(bytes, _trajectory_float_to_bits(values[i]), sizeof(bytes));
+        memcpy(&values[i], bytes, sizeof(bytes));
+    }
+}
+
+static inline bool trajectory_read_floats(FILE *file, float *values, size_t count)
+{
+    if (count != fread(values, sizeof(*values), count, file)) {
+        return false;
+    }
+
+    if (!_trajectory_is_little_endian()) {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t bits;
+            memcpy(&bits, &values[i], sizeof(bits));
+            values[i] = _trajectory_bits_to_float((uint32_t) _trajectory_decode((const uint8_t *) &bits, sizeof(bits)));
+        }
+    }
+
+    return true;
+}
+
+/* Writes TRAJECTORY_BODY_FIELDS floats for every body, in host byte order. */
+static inline void trajectory_pack_bodies(float *values, const body_t *bodies, size_t body_count)
+{
+    for (size_t i = 0; i < body_count; ++i) {
+        const body_t *body = &bodies[i];
+        *values++ = body->x;  *values++ = body->y;
+        *values++ = body->ax; *values++ = body->ay;
+        *values++ = body->vx; *values++ = body->vy;
+        *values++ = body->mass;
+    }
+}
+
+static inline bool trajectory_write_bodies(FILE *file, const body_t *bodies, size_t body_count)
+{
+    static const size_t Chunk_Body_Count = Trajectory_Chunk_Size / TRAJECTORY_BODY_FIELDS;
+
+    float values[Trajectory_Chunk_Size];
+    for (size_t begin = 0; begin < body_count; begin += Chunk_Body_Count) {
+        size_t chunk = body_count - begin < Chunk_Body_Count ? body_count - begin : Chunk_Body_Count;
+        trajectory_pack_bodies(values, &bodies[begin], chunk);
+
+        if (!trajectory_write_floats(file, values, chunk * TRAJECTORY_BODY_FIELDS)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline bool trajectory_read_bodies(FILE *file, body_t *bodies, size_t body_count)
+{
+    static const size_t Chunk_Body_Count = Trajectory_Chunk_Size / TRAJECTORY_BODY_FIELDS;
+
+    float values[Trajectory_Chunk_Size];
+    for (size_t begin = 0; begin < body_count; begin += Chunk_Body_Count) {
+        size_t chunk = body_count - begin < Chunk_Body_Count ? body_count - begin : Chunk_Body_Count;
+        if (!trajectory_read_floats(file, values, chunk * TRAJECTORY_BODY_FIELDS)) {
+            return false;
+        }
+
+        const float *value = values;
+        for (size_t i = begin; i < begin + chunk; ++i) {
+            body_t *body = &bodies[i];
+            body->x  = *value++; body->y  = *value++;
+            body->ax = *value++; body->ay = *value++;
+            body->vx = *value++; body->vy = *value++;
+            body->mass = *value++;
+        }
+    }
+
+    return true;
+}
+
+/* Text */
+
+/* "ax ay\n" with the longest numbers that `float_format_fixed` writes. */
+#define TRAJECTORY_MAX_LINE_LENGTH (2 * FLOAT_FORMAT_MAX_LENGTH + 2)
+
+/* Lines that the printers format at once before they write them. */
+#define Trajectory_Chunk_Lines 256
+
+static inline char *_trajectory_format_pair(char *text, float first, float second, char separator)
+{
+    text = float_format_fixed(text, first);
+    *text++ = separator;
+    text = float_format_fixed(text, second);
+    *text++ = '\n';
+
+    return text;
+}
+
+/*
+    Formats `count` pairs of accelerations as "ax ay" lines, with the same
+    bytes as printf("%f %f\n"). `text` must hold `count` times
+    TRAJECTORY_MAX_LINE_LENGTH characters. Returns the length.
+*/
+static inline size_t trajectory_format_accelerations(char *text, const float *accelerations, size_t count)
+{
+    char *end = text;
+    for (size_t i = 0; i < 2 * count; i += 2) {
+        end = _trajectory_format_pair(end, accelerations[i], accelerations[i + 1], ' ');
+    }
+
+    return (size_t) (end - text);
+}
+
+static inline bool trajectory_print_header(FILE *file, const trajectory_header_t *header, const body_t *bodies)
+{
+    fprintf(file, "%zu\n%f\n%f\n", (size_t) header->body_count, header->time_period, header->delta_time);
+
+    char text[Trajectory_Chunk_Lines * TRAJECTORY_MAX_LINE_LENGTH];
+    static const size_t Chunk_Body_Count = Trajectory_Chunk_Lines / 4;
+    for (size_t begin = 0; begin < header->body_count; begin += Chunk_Body_Count) {
+        size_t end = header->body_count - begin < Chunk_Body_Count ? header->body_count : begin + Chunk_Body_Count;
+
+        char *text_end = text;
+        for (size_t i = begin; i < end; ++i) {
+            const body_t *body = &bodies[i];
+            text_end = _trajectory_format_pair(text_end, body->x, body->y, ' ');
+            text_end = _trajectory_format_pair(text_end, body->ax, body->ay, ' ');
+            text_end = _trajectory_format_pair(text_end, body->vx, body->vy, ' ');
+            text_end = float_format_fixed(text_end, body->mass);
+            *text_end++ = '\n';
+        }
+
+        size_t length = (size_t) (text_end - text);
+        if (length != fwrite(text, 1, length, file)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Prints `count` pairs of accelerations, one "ax ay" line for each. */
+static inline bool trajectory_print_accelerations(FILE *file, const float *accelerations, size_t count)
+{
+    char text[Trajectory_Chunk_Lines * TRAJECTORY_MAX_LINE_LENGTH];
+    for (size_t begin = 0; begin < count; begin += Trajectory_Chunk_Lines) {
+        size_t chunk = count - begin < Trajectory_Chunk_Lines ? count - begin : Trajectory_Chunk_Lines;
+
+        size_t length = trajectory_format_accelerations(text, &accelerations[2 * begin], chunk);
+        if (length != fwrite(text, 1, length, file)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif // TRAJECTORY_H